@@ -20,146 +20,1951 @@
  * IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include "microtar-stdio.h"
+#include "microtar-hash.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <sys/sendfile.h>
+# include <sys/ioctl.h>
+# include <linux/fs.h>
+# include <linux/fiemap.h>
+#endif
+
+/* exit codes */
+#define E_TAR   1
+#define E_FS    2
+#define E_OTHER 4
+#define E_ARGS  8
+
+enum {
+    SORT_NONE,
+    SORT_INODE,
+    SORT_EXTENT,
+};
+
+enum {
+    SKIP_NONE,
+    SKIP_METADATA,
+    SKIP_CONTENT,
+};
+
+struct options {
+    int dedup;
+    int sort;
+    int preallocate;
+    int skip_unchanged;
+} options;
+
+/* Descriptor of the archive file when it is opened for reading */
+int archive_fd = -1;
+
+enum {
+    OP_LIST,
+    OP_CREATE,
+    OP_ADD,
+    OP_EXTRACT,
+    OP_CAT,
+};
+
+void die(int err, const char* msg, ...)
+{
+    fprintf(stderr, "mtar: ");
+
+    va_list ap;
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    va_end(ap);
+
+    fprintf(stderr, "\n");
+    exit(err);
+}
+
+int list_foreach_cb(mtar_t* tar, const mtar_header_t* h, void* arg)
+{
+    (void)tar;
+    (void)arg;
+    printf("%s\n", h->name);
+    return 0;
+}
+
+void list_files(mtar_t* tar)
+{
+    int err = mtar_foreach(tar, list_foreach_cb, NULL);
+    if(err)
+        die(E_TAR, "listing failed: %s", mtar_strerror(err));
+}
+
+/* Open addressed hash table of items allocated with xcalloc(), which are
+ * owned by the table. Lookups go through every item with the same hash,
+ * leaving it to the caller to check which one it's looking for. */
+struct hash_slot {
+    size_t hash;
+    void* item;
+};
+
+struct hash_table {
+    struct hash_slot* slots;
+    size_t mask;
+    size_t count;
+};
+
+struct filter_name {
+    const char* name;
+    size_t len;
+    int matched;
+};
+
+struct filter_pattern {
+    const char* pattern;
+    int matched;
+};
+
+struct name_filter {
+    struct hash_table names;    /* of struct filter_name */
+    struct filter_pattern* patterns;
+    int num_patterns;
+};
+
+void* xcalloc(size_t count, size_t size)
+{
+    void* ptr = calloc(count, size);
+    if(!ptr && count > 0 && size > 0)
+        die(E_OTHER, "out of memory");
+
+    return ptr;
+}
+
+void* xrealloc(void* ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if(!ptr && size > 0)
+        die(E_OTHER, "out of memory");
+
+    return ptr;
+}
+
+void hash_init(struct hash_table* t, size_t count)
+{
+    size_t size = 16;
+    while(size < 2 * count)
+        size *= 2;
+
+    t->slots = xcalloc(size, sizeof(struct hash_slot));
+    t->mask = size - 1;
+    t->count = 0;
+}
+
+void hash_free(struct hash_table* t)
+{
+    for(size_t i = 0; i <= t->mask; ++i)
+        free(t->slots[i].item);
+
+    free(t->slots);
+}
+
+/* Returns the next item with the given hash, starting the search at slot
+ * '*iter' and updating it, or NULL if there are no more */
+void* hash_next(const struct hash_table* t, size_t hash, size_t* iter)
+{
+    for(size_t i = *iter; t->slots[i].item; i = (i + 1) & t->mask) {
+        if(t->slots[i].hash == hash) {
+            *iter = (i + 1) & t->mask;
+            return t->slots[i].item;
+        }
+    }
+
+    return NULL;
+}
+
+void* hash_first(const struct hash_table* t, size_t hash, size_t* iter)
+{
+    *iter = hash & t->mask;
+    return hash_next(t, hash, iter);
+}
+
+void hash_insert(struct hash_table* t, size_t hash, void* item)
+{
+    /* keep the hash table at most half full */
+    if(2 * (t->count + 1) > t->mask + 1) {
+        struct hash_table old = *t;
+        t->slots = xcalloc(2 * (old.mask + 1), sizeof(struct hash_slot));
+        t->mask = 2 * old.mask + 1;
+        t->count = 0;
+
+        for(size_t i = 0; i <= old.mask; ++i)
+            if(old.slots[i].item)
+                hash_insert(t, old.slots[i].hash, old.slots[i].item);
+
+        free(old.slots);
+    }
+
+    size_t i = hash & t->mask;
+    while(t->slots[i].item)
+        i = (i + 1) & t->mask;
+
+    t->slots[i].hash = hash;
+    t->slots[i].item = item;
+    t->count++;
+}
+
+size_t strip_slashes(const char* name)
+{
+    size_t len = strlen(name);
+    while(len > 1 && name[len - 1] == '/')
+        --len;
+
+    return len;
+}
+
+struct filter_name* filter_lookup(struct name_filter* f, const char* name, size_t len)
+{
+    size_t hash = mtar_hash_bytes(name, len), i;
+    struct filter_name* e = hash_first(&f->names, hash, &i);
+    for(; e; e = hash_next(&f->names, hash, &i))
+        if(e->len == len && !memcmp(e->name, name, len))
+            return e;
+
+    return NULL;
+}
+
+void filter_compile(struct name_filter* f, char** names, int count)
+{
+    hash_init(&f->names, count);
+    f->patterns = xcalloc(count, sizeof(struct filter_pattern));
+    f->num_patterns = 0;
+
+    for(int i = 0; i < count; ++i) {
+        if(strpbrk(names[i], "*?[")) {
+            f->patterns[f->num_patterns++].pattern = names[i];
+            continue;
+        }
+
+        size_t len = strip_slashes(names[i]);
+        if(filter_lookup(f, names[i], len))
+            continue;
+
+        struct filter_name* e = xcalloc(1, sizeof(struct filter_name));
+        e->name = names[i];
+        e->len = len;
+        hash_insert(&f->names, mtar_hash_bytes(names[i], len), e);
+    }
+}
+
+void filter_free(struct name_filter* f)
+{
+    hash_free(&f->names);
+    free(f->patterns);
+}
+
+int filter_match(struct name_filter* f, const char* name)
+{
+    size_t len = strip_slashes(name);
+    int match = 0;
+
+    /* a member matches if it, or any directory containing it, was named;
+     * every such name is marked, since each of them has been found */
+    for(size_t i = 1; i <= len; ++i) {
+        if(i != len && name[i] != '/')
+            continue;
+
+        struct filter_name* e = filter_lookup(f, name, i);
+        if(e) {
+            e->matched = 1;
+            match = 1;
+        }
+    }
+
+    for(int i = 0; i < f->num_patterns; ++i) {
+        if(!fnmatch(f->patterns[i].pattern, name, 0)) {
+            f->patterns[i].matched = 1;
+            match = 1;
+        }
+    }
+
+    return match;
+}
+
+int filter_report_unmatched(struct name_filter* f)
+{
+    int unmatched = 0;
+
+    for(size_t i = 0; i <= f->names.mask; ++i) {
+        struct filter_name* e = f->names.slots[i].item;
+        if(e && !e->matched) {
+            fprintf(stderr, "mtar: \"%s\" not found in archive\n", e->name);
+            unmatched = 1;
+        }
+    }
+
+    for(int i = 0; i < f->num_patterns; ++i) {
+        if(!f->patterns[i].matched) {
+            fprintf(stderr, "mtar: \"%s\" not found in archive\n", f->patterns[i].pattern);
+            unmatched = 1;
+        }
+    }
+
+    return unmatched;
+}
+
+/* Checks if any component of the path is "..", which could lead out of
+ * the directory being extracted to */
+int has_dotdot(const char* path)
+{
+    for(const char* comp = path; *comp; ) {
+        size_t len = strcspn(comp, "/");
+        if(len == 2 && comp[0] == '.' && comp[1] == '.')
+            return 1;
+
+        comp += len;
+        comp += strspn(comp, "/");
+    }
+
+    return 0;
+}
+
+/* member names are at most 100 characters, so can't be nested deeper */
+#define DIR_CACHE_DEPTH 64
+
+/* Open fds for the directories leading to the most recently extracted
+ * member. Archives usually keep the members of a directory together, so
+ * most members only need one lookup in their parent directory. */
+struct dir_cache {
+    char names[PATH_MAX];           /* null terminated components */
+    size_t ends[DIR_CACHE_DEPTH];   /* end of each component in names */
+    int fds[DIR_CACHE_DEPTH];
+    int depth;
+};
+
+void dir_cache_trim(struct dir_cache* c, int depth)
+{
+    while(c->depth > depth)
+        close(c->fds[--c->depth]);
+}
+
+/* Returns an fd for the directory containing 'path', creating any missing
+ * directories on the way if 'create' is set, and points 'base' at the last
+ * component. Symbolic links are never followed, so nothing outside of the
+ * current directory can be reached. The fd is owned by the cache. Returns
+ * -1 and sets errno on failure, to ELOOP if the path has a symbolic link. */
+int dir_cache_parent(struct dir_cache* c, const char* path, const char** base, int create)
+{
+    const char* slash = strrchr(path, '/');
+    *base = slash ? slash + 1 : path;
+
+    int fd = AT_FDCWD, level = 0;
+    for(const char* comp = path; slash && comp < slash; ) {
+        size_t len = strcspn(comp, "/");
+        if(len == 0 || (len == 1 && comp[0] == '.')) {
+            comp += len + 1;
+            continue;
+        }
+
+        size_t start = level > 0 ? c->ends[level - 1] + 1 : 0;
+        if(level < c->depth && c->ends[level] - start == len &&
+           !memcmp(&c->names[start], comp, len)) {
+            fd = c->fds[level++];
+            comp += len + 1;
+            continue;
+        }
+
+        dir_cache_trim(c, level);
+        if(level == DIR_CACHE_DEPTH || start + len >= sizeof(c->names)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        char* name = &c->names[start];
+        memcpy(name, comp, len);
+        name[len] = '\0';
+
+        /* most directories exist, so only try creating them after that fails */
+        int subfd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if(subfd < 0 && errno == ENOENT && create) {
+            if(mkdirat(fd, name, 0755) != 0 && errno != EEXIST)
+                return -1;
+
+            subfd = openat(fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        }
+
+        /* Linux reports a symbolic link as ENOTDIR when O_DIRECTORY is
+         * given, so check which it was */
+        struct stat st;
+        if(subfd < 0 && errno == ENOTDIR &&
+           !fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) && S_ISLNK(st.st_mode))
+            errno = ELOOP;
+
+        if(subfd < 0)
+            return -1;
+
+        c->ends[level] = start + len;
+        c->fds[level] = subfd;
+        c->depth = ++level;
+        fd = subfd;
+        comp += len + 1;
+    }
+
+    return fd;
+}
+
+struct file_entry {
+    unsigned pos;   /* header position of the latest member */
+    char name[];
+};
+
+struct file_entry* file_lookup(struct hash_table* t, const char* name, size_t hash)
+{
+    size_t i;
+    struct file_entry* e = hash_first(t, hash, &i);
+    for(; e; e = hash_next(t, hash, &i))
+        if(!strcmp(e->name, name))
+            return e;
+
+    return NULL;
+}
+
+/* Records the position of a member that hard links may point at; a later
+ * member with the same name replaces it */
+void file_remember(struct hash_table* t, mtar_t* tar, const mtar_header_t* h)
+{
+    if(h->type != MTAR_TREG && h->type != MTAR_TSPARSE && h->type != MTAR_TLNK)
+        return;
+
+    size_t hash = mtar_hash_bytes(h->name, strlen(h->name));
+    struct file_entry* e = file_lookup(t, h->name, hash);
+    if(!e) {
+        e = xcalloc(1, sizeof(struct file_entry) + strlen(h->name) + 1);
+        strcpy(e->name, h->name);
+        hash_insert(t, hash, e);
+    }
+
+    e->pos = mtar_tell_member(tar);
+}
+
+/* Seeks to the member the hard link 'h' points to and returns its header.
+ * Links may point at other links, but always at a member earlier in the
+ * archive, which rules out loops. Returns NULL if a target is missing,
+ * leaving the archive on the link that points at it. */
+const mtar_header_t* seek_link_target(mtar_t* tar, const mtar_header_t* h,
+                                      struct hash_table* files, const char* name)
+{
+    unsigned at = mtar_tell_member(tar);
+    while(h->type == MTAR_TLNK) {
+        size_t hash = mtar_hash_bytes(h->linkname, strlen(h->linkname));
+        struct file_entry* e = file_lookup(files, h->linkname, hash);
+        if(!e || e->pos >= at)
+            return NULL;
+
+        at = e->pos;
+        int err = mtar_seek_member(tar, at);
+        if(err)
+            die(E_TAR, "reading \"%s\" failed: %s", name, mtar_strerror(err));
+
+        h = mtar_get_header(tar);
+    }
+
+    return h;
+}
+
+struct dir_mode {
+    mode_t mode;
+    char path[];
+};
+
+struct extract_args {
+    struct name_filter filter;
+    int count;
+    struct dir_cache dirs;
+    struct dir_cache targets;   /* for the targets of hard links */
+    struct hash_table files;    /* of struct file_entry */
+    struct dir_mode** modes;    /* created directories, in creation order */
+    size_t num_modes;
+    size_t alloc_modes;
+};
+
+/* Remembers the mode of a created directory, which is only applied once
+ * everything has been extracted, so a read-only directory can still be
+ * filled in */
+void dir_mode_add(struct extract_args* args, const char* path, mode_t mode)
+{
+    if(args->num_modes == args->alloc_modes) {
+        args->alloc_modes = args->alloc_modes ? 2 * args->alloc_modes : 64;
+        args->modes = xrealloc(args->modes, args->alloc_modes * sizeof(struct dir_mode*));
+    }
+
+    struct dir_mode* m = xcalloc(1, sizeof(struct dir_mode) + strlen(path) + 1);
+    m->mode = mode;
+    strcpy(m->path, path);
+    args->modes[args->num_modes++] = m;
+}
+
+/* Applies the modes of the created directories. A directory is always
+ * created after its parent, so going backwards does the deepest first
+ * and each one is still writable while its children are changed. */
+void dir_mode_apply(struct extract_args* args)
+{
+    mode_t mask = umask(0);
+    umask(mask);
+
+    for(size_t i = args->num_modes; i-- > 0; ) {
+        struct dir_mode* m = args->modes[i];
+        const char* base;
+        int dirfd = dir_cache_parent(&args->dirs, m->path, &base, 0);
+        int fd = dirfd == -1 ? -1 : openat(dirfd, base, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+        if(fd < 0 || fchmod(fd, m->mode & ~mask) != 0)
+            fprintf(stderr, "warning: cannot set the mode of \"%s\": %s\n",
+                    m->path, strerror(errno));
+
+        if(fd >= 0)
+            close(fd);
+        free(m);
+    }
+
+    free(args->modes);
+    args->modes = NULL;
+    args->num_modes = args->alloc_modes = 0;
+}
+
+void write_all(int fd, const char* buf, size_t count, const char* name)
+{
+    while(count > 0) {
+        ssize_t wcount = write(fd, buf, count);
+        if(wcount < 0) {
+            if(errno == EINTR)
+                continue;
+            die(E_FS, "writing \"%s\" failed: %s", name, strerror(errno));
+        }
+
+        buf += wcount;
+        count -= wcount;
+    }
+}
+
+/* granularity at which runs of zeros are turned into holes */
+#define HOLE_BLOCK 4096
+
+int is_zero(const char* buf, size_t len)
+{
+    /* comparing the buffer with itself shifted by one byte lets memcmp()
+     * do the work, which the C library already vectorizes */
+    return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
+
+/* Copies 'len' bytes of member data to the file, returning nonzero if
+ * the file ends in a hole that still has to be sized with ftruncate(). */
+int extract_data(mtar_t* tar, int fd, unsigned len, const char* name)
+{
+    /* Blocks of zeros are skipped over with lseek() instead of written,
+     * leaving holes in the output file. The buffer size is a multiple of
+     * HOLE_BLOCK so the blocks stay aligned to the file offset. */
+    static char iobuf[64 * 1024];
+    int in_hole = 0;
+    while(len > 0) {
+        unsigned n = len < sizeof(iobuf) ? len : sizeof(iobuf);
+        int rcount = mtar_read_data(tar, iobuf, n);
+        if(rcount < 0)
+            die(E_TAR, "extracting \"%s\" failed: %s", name, mtar_strerror(rcount));
+        if(rcount == 0)
+            die(E_TAR, "extracting \"%s\" failed: %s", name, mtar_strerror(MTAR_EREADFAIL));
+
+        int i = 0;
+        while(i < rcount) {
+            int start = i, zero = -1;
+            while(i < rcount) {
+                int blk = rcount - i < HOLE_BLOCK ? rcount - i : HOLE_BLOCK;
+                int z = is_zero(&iobuf[i], blk);
+                if(zero >= 0 && z != zero)
+                    break;
+
+                zero = z;
+                i += blk;
+            }
+
+            if(zero) {
+                if(lseek(fd, i - start, SEEK_CUR) < 0)
+                    die(E_FS, "extracting \"%s\" failed: %s", name, strerror(errno));
+            } else {
+                write_all(fd, &iobuf[start], i - start, name);
+            }
+
+            in_hole = zero;
+        }
+
+        len -= rcount;
+    }
+
+    return in_hole;
+}
+
+/* Checks that the extents are in order, don't overlap and stay inside
+ * the file, so neither extracting nor cat can be sent out of bounds */
+void check_sparse_map(const mtar_header_t* h, const mtar_sparse_t* map,
+                      int count, unsigned realsize)
+{
+    unsigned pos = 0;
+    for(int i = 0; i < count; ++i) {
+        if(map[i].offset < pos || map[i].offset > realsize ||
+           map[i].size > realsize - map[i].offset)
+            die(E_TAR, "reading \"%s\" failed: bad sparse map", h->name);
+
+        pos = map[i].offset + map[i].size;
+    }
+}
+
+/* Reads the extents of a sparse member into 'small_map' if they fit, or
+ * else into an allocated map, which is returned in 'mapp' either way.
+ * The map is checked with check_sparse_map() before it's returned. */
+int load_sparse_map(mtar_t* tar, const mtar_header_t* h, mtar_sparse_t* small_map,
+                    int small_count, mtar_sparse_t** mapp, unsigned* realsize)
+{
+    mtar_sparse_t* map = small_map;
+
+    int count = mtar_read_sparse_map(tar, map, small_count, realsize);
+    if(count > small_count) {
+        map = xcalloc(count, sizeof(mtar_sparse_t));
+        count = mtar_read_sparse_map(tar, map, count, realsize);
+    }
+
+    if(count < 0)
+        die(E_TAR, "reading \"%s\" failed: %s", h->name, mtar_strerror(count));
+
+    check_sparse_map(h, map, count, *realsize);
+
+    *mapp = map;
+    return count;
+}
+
+void extract_sparse(mtar_t* tar, const mtar_header_t* h, int fd)
+{
+    /* most files have only a few extents, so try with a small map first */
+    mtar_sparse_t small_map[16];
+    mtar_sparse_t* map;
+    unsigned realsize;
+    int count = load_sparse_map(tar, h, small_map, 16, &map, &realsize);
+
+    /* the extents are stored back to back in the member's data */
+    for(int i = 0; i < count; ++i) {
+        if(lseek(fd, map[i].offset, SEEK_SET) < 0)
+            die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+
+        extract_data(tar, fd, map[i].size, h->name);
+    }
+
+    if(ftruncate(fd, realsize) != 0)
+        die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+
+    if(map != small_map)
+        free(map);
+}
+
+/* Checks if the existing file already has the member's contents. If its
+ * data had to be read to find out, the member is rewound afterwards. */
+int is_unchanged(mtar_t* tar, const mtar_header_t* h, int dirfd, const char* base)
+{
+    struct stat st;
+    if(fstatat(dirfd, base, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+       !S_ISREG(st.st_mode) || st.st_size != (off_t)h->size)
+        return 0;
+
+    if(options.skip_unchanged == SKIP_METADATA)
+        return st.st_mtime == (time_t)h->mtime;
+
+    int fd = openat(dirfd, base, O_RDONLY|O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+
+    static char tar_buf[64 * 1024], file_buf[64 * 1024];
+    int same = 1;
+    while(same && !mtar_eof_data(tar)) {
+        int rcount = mtar_read_data(tar, tar_buf, sizeof(tar_buf));
+        if(rcount < 0)
+            die(E_TAR, "extracting \"%s\" failed: %s", h->name, mtar_strerror(rcount));
+
+        same = read(fd, file_buf, rcount) == rcount && !memcmp(tar_buf, file_buf, rcount);
+    }
+
+    /* files which were only touched get the archived mtime back, so they
+     * match on the metadata alone next time */
+    if(same && st.st_mtime != (time_t)h->mtime) {
+        struct timespec times[2] = { { 0, UTIME_OMIT }, { h->mtime, 0 } };
+        futimens(fd, times);
+    }
+
+    close(fd);
+
+    if(!same) {
+        int err = mtar_seek_data(tar, 0, SEEK_SET);
+        if(err)
+            die(E_TAR, "extracting \"%s\" failed: %s", h->name, mtar_strerror(err));
+    }
+
+    return same;
+}
+
+/* Writes the data of a regular or sparse member to a new file */
+void extract_file(mtar_t* tar, const mtar_header_t* h, int dirfd, const char* base)
+{
+    /* Start from a new file rather than truncating the old one, which
+     * could be a hard link sharing its data with another file, or a
+     * symbolic link pointing anywhere. Directories are never replaced. */
+    if(unlinkat(dirfd, base, 0) != 0 && errno != ENOENT)
+        die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+
+    int fd = openat(dirfd, base, O_CREAT|O_EXCL|O_WRONLY|O_CLOEXEC, h->mode);
+    if(fd < 0)
+        die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+
+    /* reserve all the space up front; running out fails here instead of
+     * part way through, and the filesystem can allocate one extent */
+    if(options.preallocate && h->type == MTAR_TREG && h->size > 0) {
+#ifdef __linux__
+        /* glibc's posix_fallocate() writes every block if the filesystem
+         * can't allocate space, which is slower than not preallocating */
+        int err = fallocate(fd, 0, 0, h->size) != 0 ? errno : 0;
+#else
+        int err = posix_fallocate(fd, 0, h->size);
+#endif
+        if(err && err != EINVAL && err != EOPNOTSUPP && err != ENOSYS)
+            die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(err));
+    }
+
+    if(h->type == MTAR_TSPARSE) {
+        extract_sparse(tar, h, fd);
+    } else {
+        /* a trailing hole needs the file size to be set explicitly */
+        int in_hole = extract_data(tar, fd, h->size, h->name);
+        if(in_hole && ftruncate(fd, h->size) != 0)
+            die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+    }
+
+    /* keep the archived mtime so unchanged files can be recognized later */
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { h->mtime, 0 } };
+    if(futimens(fd, times) != 0)
+        die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+
+    close(fd);
+}
+
+/* Extracts the file a hard link points to in place of the link, for when
+ * the target wasn't extracted, then goes back to the link */
+void extract_link_data(mtar_t* tar, const mtar_header_t* h, struct hash_table* files,
+                       int dirfd, const char* base)
+{
+    /* 'h' is the archive's header buffer, which seeking overwrites */
+    char name[sizeof(h->name)];
+    strcpy(name, h->name);
+
+    unsigned pos = mtar_tell_member(tar);
+    h = seek_link_target(tar, h, files, name);
+    if(h)
+        extract_file(tar, h, dirfd, base);
+    else
+        fprintf(stderr, "warning: not extracting \"%s\", link target \"%s\" not found\n",
+                name, mtar_get_header(tar)->linkname);
+
+    int err = mtar_seek_member(tar, pos);
+    if(err)
+        die(E_TAR, "extracting \"%s\" failed: %s", name, mtar_strerror(err));
+}
+
+int extract_foreach_cb(mtar_t* tar, const mtar_header_t* h, void* arg)
+{
+    struct extract_args* args = arg;
+
+    /* files that aren't extracted may still be needed for a hard link */
+    file_remember(&args->files, tar, h);
+
+    /* skipping a member only needs its header, the data is never read */
+    if(args->count > 0 && !filter_match(&args->filter, h->name))
+        return 0;
+
+    if(h->type != MTAR_TREG && h->type != MTAR_TSPARSE && h->type != MTAR_TDIR &&
+       h->type != MTAR_TLNK && h->type != MTAR_TSYM) {
+        fprintf(stderr, "warning: not extracting unsupported type \"%s\"\n", h->name);
+        return 0;
+    }
+
+    /* leading slashes are dropped and names with ".." are refused, so
+     * everything lands under the current directory; the member is then
+     * created relative to its parent */
+    const char* name = h->name;
+    while(*name == '/')
+        ++name;
+
+    if(has_dotdot(name)) {
+        fprintf(stderr, "warning: not extracting \"%s\", which is outside the"
+                " current directory\n", h->name);
+        return 0;
+    }
+
+    char path[sizeof(h->name)];
+    size_t len = strip_slashes(name);
+    if(len == 0)
+        return 0;
+
+    memcpy(path, name, len);
+    path[len] = '\0';
+
+    const char* base;
+    int dirfd = dir_cache_parent(&args->dirs, path, &base, 1);
+    if(dirfd == -1 && errno == ELOOP) {
+        fprintf(stderr, "warning: not extracting \"%s\" through a symbolic link\n", h->name);
+        return 0;
+    }
+
+    if(dirfd == -1)
+        die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+
+    /* directories stay writable until the end, see dir_mode_apply() */
+    if(h->type == MTAR_TDIR) {
+        if(mkdirat(dirfd, base, 0700) == 0)
+            dir_mode_add(args, path, h->mode);
+        else if(errno != EEXIST)
+            die(E_FS, "cannot create directory \"%s\": %s", h->name, strerror(errno));
+        return 0;
+    }
+
+    if(h->type == MTAR_TLNK) {
+        const char* target = h->linkname;
+        while(*target == '/')
+            ++target;
+
+        if(has_dotdot(target)) {
+            fprintf(stderr, "warning: not extracting \"%s\", link target is outside"
+                    " the current directory\n", h->name);
+            return 0;
+        }
+
+        /* the target is looked up without following symbolic links too */
+        const char* target_base;
+        int target_dirfd = dir_cache_parent(&args->targets, target, &target_base, 0);
+        if(target_dirfd == -1 && errno == ELOOP) {
+            fprintf(stderr, "warning: not extracting \"%s\", link target is reached"
+                    " through a symbolic link\n", h->name);
+            return 0;
+        }
+
+        if(target_dirfd == -1 && errno != ENOENT)
+            die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+
+        /* replace whatever is in the way, like extracting a file would,
+         * unless it already is the same file */
+        if(target_dirfd != -1 && linkat(target_dirfd, target_base, dirfd, base, 0) == 0)
+            return 0;
+
+        /* a target that wasn't extracted is written out as a copy */
+        int err = target_dirfd == -1 ? ENOENT : errno;
+        if(err == ENOENT) {
+            extract_link_data(tar, h, &args->files, dirfd, base);
+            return 0;
+        }
+
+        struct stat st_target, st_old;
+        if(err == EEXIST && !fstatat(target_dirfd, target_base, &st_target, AT_SYMLINK_NOFOLLOW) &&
+           !fstatat(dirfd, base, &st_old, AT_SYMLINK_NOFOLLOW) &&
+           st_target.st_dev == st_old.st_dev && st_target.st_ino == st_old.st_ino)
+            return 0;
+
+        errno = err;
+        if(err != EEXIST || unlinkat(dirfd, base, 0) != 0 ||
+           linkat(target_dirfd, target_base, dirfd, base, 0) != 0)
+            die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+        return 0;
+    }
+
+    if(h->type == MTAR_TSYM) {
+        if(symlinkat(h->linkname, dirfd, base) != 0 &&
+           (errno != EEXIST || unlinkat(dirfd, base, 0) != 0 ||
+            symlinkat(h->linkname, dirfd, base) != 0))
+            die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+        return 0;
+    }
+
+    if(options.skip_unchanged && h->type == MTAR_TREG && is_unchanged(tar, h, dirfd, base))
+        return 0;
+
+    extract_file(tar, h, dirfd, base);
+    return 0;
+}
+
+
+void extract_files(mtar_t* tar, char** files, int num_files)
+{
+    static struct extract_args args;
+    args.count = num_files;
+    args.dirs.depth = 0;
+    args.targets.depth = 0;
+    hash_init(&args.files, 0);
+    if(num_files > 0)
+        filter_compile(&args.filter, files, num_files);
+
+    int err = mtar_foreach(tar, extract_foreach_cb, &args);
+    if(err)
+        die(E_TAR, "extraction failed: %s", mtar_strerror(err));
+
+    dir_mode_apply(&args);
+    dir_cache_trim(&args.dirs, 0);
+    dir_cache_trim(&args.targets, 0);
+    hash_free(&args.files);
+
+    if(num_files > 0) {
+        int unmatched = filter_report_unmatched(&args.filter);
+        filter_free(&args.filter);
+        if(unmatched)
+            exit(E_TAR);
+    }
+}
+
+/* Copies 'len' bytes of member data to the output */
+void cat_range(mtar_t* tar, const mtar_header_t* h, unsigned len, int out_fd)
+{
+    static char iobuf[64 * 1024];
+    while(len > 0) {
+        unsigned n = len < sizeof(iobuf) ? len : sizeof(iobuf);
+        int rcount = mtar_read_data(tar, iobuf, n);
+        if(rcount < 0)
+            die(E_TAR, "reading \"%s\" failed: %s", h->name, mtar_strerror(rcount));
+        if(rcount == 0)
+            die(E_TAR, "reading \"%s\" failed: %s", h->name, mtar_strerror(MTAR_EREADFAIL));
+
+        write_all(out_fd, iobuf, rcount, "standard output");
+        len -= rcount;
+    }
+}
+
+void cat_data(mtar_t* tar, const mtar_header_t* h, int out_fd)
+{
+#ifdef __linux__
+    /* Have the kernel move the data directly from the archive to the
+     * output. This needs a regular file as the archive, so fall back
+     * to copying if the first call is refused. */
+    off_t off = mtar_data_offset(tar);
+    unsigned done = 0;
+    while(archive_fd >= 0 && done < h->size) {
+        ssize_t count = sendfile(out_fd, archive_fd, &off, h->size - done);
+        if(count < 0 && errno == EINTR)
+            continue;
+        if(count < 0 && done == 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if(count < 0)
+            die(E_FS, "reading \"%s\" failed: %s", h->name, strerror(errno));
+        if(count == 0)
+            die(E_TAR, "reading \"%s\" failed: %s", h->name, mtar_strerror(MTAR_EREADFAIL));
+
+        done += count;
+    }
+
+    if(done == h->size)
+        return;
+#endif
+
+    cat_range(tar, h, h->size, out_fd);
+}
+
+void cat_zeros(unsigned len, int out_fd)
+{
+    static const char zeros[64 * 1024];
+    while(len > 0) {
+        unsigned n = len < sizeof(zeros) ? len : sizeof(zeros);
+        write_all(out_fd, zeros, n, "standard output");
+        len -= n;
+    }
+}
+
+void cat_sparse(mtar_t* tar, const mtar_header_t* h, int out_fd)
+{
+    mtar_sparse_t small_map[16];
+    mtar_sparse_t* map;
+    unsigned realsize;
+    int count = load_sparse_map(tar, h, small_map, 16, &map, &realsize);
+
+    /* the holes between the extents are filled in with zeros */
+    unsigned pos = 0;
+    for(int i = 0; i < count; ++i) {
+        cat_zeros(map[i].offset - pos, out_fd);
+        cat_range(tar, h, map[i].size, out_fd);
+        pos = map[i].offset + map[i].size;
+    }
+
+    cat_zeros(realsize - pos, out_fd);
+
+    if(map != small_map)
+        free(map);
+}
+
+struct cat_args {
+    struct name_filter filter;
+    struct hash_table files;    /* of struct file_entry */
+};
+
+/* Outputs the contents of the file a hard link points to, then goes back
+ * to the link */
+void cat_link(mtar_t* tar, const mtar_header_t* h, struct hash_table* files)
+{
+    /* 'h' is the archive's header buffer, which seeking overwrites */
+    char name[sizeof(h->name)];
+    strcpy(name, h->name);
+
+    unsigned pos = mtar_tell_member(tar);
+    h = seek_link_target(tar, h, files, name);
+    if(!h)
+        fprintf(stderr, "warning: not outputting \"%s\", link target \"%s\" not found\n",
+                name, mtar_get_header(tar)->linkname);
+    else if(h->type == MTAR_TREG)
+        cat_data(tar, h, STDOUT_FILENO);
+    else if(h->type == MTAR_TSPARSE)
+        cat_sparse(tar, h, STDOUT_FILENO);
+
+    int err = mtar_seek_member(tar, pos);
+    if(err)
+        die(E_TAR, "reading \"%s\" failed: %s", name, mtar_strerror(err));
+}
+
+int cat_foreach_cb(mtar_t* tar, const mtar_header_t* h, void* arg)
+{
+    struct cat_args* args = arg;
+
+    /* every file is remembered, since a link may point at one that
+     * wasn't named */
+    file_remember(&args->files, tar, h);
+
+    if(!filter_match(&args->filter, h->name))
+        return 0;
+
+    /* naming a directory outputs the files inside it */
+    if(h->type == MTAR_TREG)
+        cat_data(tar, h, STDOUT_FILENO);
+    else if(h->type == MTAR_TSPARSE)
+        cat_sparse(tar, h, STDOUT_FILENO);
+    else if(h->type == MTAR_TLNK)
+        cat_link(tar, h, &args->files);
+    else if(h->type != MTAR_TDIR)
+        fprintf(stderr, "warning: not outputting unsupported type \"%s\"\n", h->name);
+
+    return 0;
+}
+
+void cat_files(mtar_t* tar, char** files, int num_files)
+{
+    struct cat_args args;
+    filter_compile(&args.filter, files, num_files);
+    hash_init(&args.files, 0);
+
+    int err = mtar_foreach(tar, cat_foreach_cb, &args);
+    if(err)
+        die(E_TAR, "reading failed: %s", mtar_strerror(err));
+
+    int unmatched = filter_report_unmatched(&args.filter);
+    filter_free(&args.filter);
+    hash_free(&args.files);
+    if(unmatched)
+        exit(E_TAR);
+}
+
+struct link_entry {
+    dev_t dev;
+    ino_t ino;
+    char name[];    /* first member added for this inode */
+};
+
+size_t hash_inode(dev_t dev, ino_t ino)
+{
+    unsigned long long h = (unsigned long long)ino * 0x9e3779b97f4a7c15ull;
+    h ^= (unsigned long long)dev + (h >> 29);
+    return (size_t)(h ^ (h >> 32));
+}
+
+/* Returns the name of an earlier member with the same inode, or NULL after
+ * remembering the name for later hard links to the file. */
+const char* link_find_or_add(struct hash_table* t, const struct stat* st, const char* name)
+{
+    size_t hash = hash_inode(st->st_dev, st->st_ino), i;
+    struct link_entry* e = hash_first(t, hash, &i);
+    for(; e; e = hash_next(t, hash, &i))
+        if(e->dev == st->st_dev && e->ino == st->st_ino)
+            return e->name;
+
+    e = xcalloc(1, sizeof(struct link_entry) + strlen(name) + 1);
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    strcpy(e->name, name);
+    hash_insert(t, hash, e);
+    return NULL;
+}
+
+struct content_entry {
+    off_t size;
+    int hashed;     /* 'hash' is only set once another file has this size */
+    unsigned long long hash;
+    char name[];    /* first member added with this content */
+};
+
+size_t hash_size(off_t size)
+{
+    unsigned long long h = (unsigned long long)size * 0x9e3779b97f4a7c15ull;
+    return (size_t)(h ^ (h >> 32));
+}
+
+unsigned long long hash_data(unsigned long long h, const char* buf, size_t len)
+{
+    /* Mixes in 8 bytes at a time. This only needs to be good enough to
+     * find candidates, which are always compared byte for byte. */
+    unsigned long long w;
+    for(; len >= 8; buf += 8, len -= 8) {
+        memcpy(&w, buf, 8);
+        h ^= w;
+        h = (h << 31 | h >> 33) * 0x9e3779b97f4a7c15ull;
+    }
+
+    if(len > 0) {
+        w = 0;
+        memcpy(&w, buf, len);
+        h ^= w ^ len;
+        h = (h << 31 | h >> 33) * 0x9e3779b97f4a7c15ull;
+    }
+
+    return h ^ (h >> 29);
+}
+
+void read_full(int fd, char* buf, size_t len, const char* name)
+{
+    while(len > 0) {
+        ssize_t rcount = read(fd, buf, len);
+        if(rcount < 0 && errno == EINTR)
+            continue;
+        if(rcount < 0)
+            die(E_FS, "reading \"%s\" failed: %s", name, strerror(errno));
+        if(rcount == 0)
+            die(E_FS, "reading \"%s\" failed: file shrank while reading", name);
+
+        buf += rcount;
+        len -= rcount;
+    }
+}
+
+unsigned long long hash_file(int fd, off_t size, const char* name)
+{
+    static char iobuf[64 * 1024];
+    unsigned long long h = 0xcbf29ce484222325ull;
+    while(size > 0) {
+        size_t n = size < (off_t)sizeof(iobuf) ? (size_t)size : sizeof(iobuf);
+        read_full(fd, iobuf, n, name);
+        h = hash_data(h, iobuf, n);
+        size -= n;
+    }
+
+    if(lseek(fd, 0, SEEK_SET) < 0)
+        die(E_FS, "reading \"%s\" failed: %s", name, strerror(errno));
+
+    return h;
+}
+
+int same_content(int fd, const char* other, off_t size, const char* name)
+{
+    static char buf_a[64 * 1024], buf_b[64 * 1024];
+    int equal = 1;
 
-/* exit codes */
-#define E_TAR   1
-#define E_FS    2
-#define E_OTHER 4
-#define E_ARGS  8
+    int ofd = open(other, O_RDONLY);
+    if(ofd < 0)
+        return 0;
 
-enum {
-    OP_LIST,
-    OP_CREATE,
-    OP_EXTRACT,
-};
+    while(equal && size > 0) {
+        size_t n = size < (off_t)sizeof(buf_a) ? (size_t)size : sizeof(buf_a);
+        read_full(fd, buf_a, n, name);
+        read_full(ofd, buf_b, n, other);
+        equal = !memcmp(buf_a, buf_b, n);
+        size -= n;
+    }
 
-void die(int err, const char* msg, ...)
+    close(ofd);
+    if(lseek(fd, 0, SEEK_SET) < 0)
+        die(E_FS, "reading \"%s\" failed: %s", name, strerror(errno));
+
+    return equal;
+}
+
+/* Returns the name of an earlier member with identical contents, or NULL
+ * after remembering the file as a candidate for later ones. Files are
+ * keyed on their size and only hashed once another file has the same
+ * size, so most files are never read twice. */
+const char* content_find_or_add(struct hash_table* t, int fd, const struct stat* st, const char* name)
 {
-    fprintf(stderr, "mtar: ");
+    size_t key = hash_size(st->st_size);
+    unsigned long long hash = 0;
+    int hashed = 0;
+    size_t i;
 
-    va_list ap;
-    va_start(ap, msg);
-    vfprintf(stderr, msg, ap);
-    va_end(ap);
+    /* different contents can share a hash, so check every match */
+    struct content_entry* e = hash_first(t, key, &i);
+    for(; e; e = hash_next(t, key, &i)) {
+        if(e->size != st->st_size)
+            continue;
 
-    fprintf(stderr, "\n");
-    exit(err);
+        if(!hashed) {
+            hash = hash_file(fd, st->st_size, name);
+            hashed = 1;
+        }
+
+        /* the earlier file is hashed now that it has company */
+        if(!e->hashed) {
+            int efd = open(e->name, O_RDONLY);
+            if(efd < 0)
+                continue;
+
+            e->hash = hash_file(efd, e->size, e->name);
+            e->hashed = 1;
+            close(efd);
+        }
+
+        if(e->hash == hash && same_content(fd, e->name, st->st_size, name))
+            return e->name;
+    }
+
+    e = xcalloc(1, sizeof(struct content_entry) + strlen(name) + 1);
+    e->size = st->st_size;
+    e->hashed = hashed;
+    e->hash = hash;
+    strcpy(e->name, name);
+    hash_insert(t, key, e);
+    return NULL;
 }
 
-int list_foreach_cb(mtar_t* tar, const mtar_header_t* h, void* arg)
+/* Fills in a header for 'path', keeping the permissions and mtime of the
+ * file so extraction can restore them and spot unchanged files */
+void fill_header(mtar_header_t* h, const char* path, const struct stat* st, unsigned type)
 {
-    (void)tar;
-    (void)arg;
-    printf("%s\n", h->name);
-    return 0;
+    memset(h, 0, sizeof(*h));
+    if(strlen(path) >= sizeof(h->name))
+        die(E_TAR, "adding \"%s\" failed: %s", path, mtar_strerror(MTAR_ENAMETOOLONG));
+
+    strcpy(h->name, path);
+    h->mode = st->st_mode & 07777;
+    h->mtime = st->st_mtime < 0 ? 0 : st->st_mtime;
+    h->type = type;
 }
 
-void list_files(mtar_t* tar)
+void add_link(mtar_t* tar, const char* name, const char* target, const struct stat* st)
 {
-    int err = mtar_foreach(tar, list_foreach_cb, NULL);
+    mtar_header_t h;
+    fill_header(&h, name, st, MTAR_TLNK);
+    strcpy(h.linkname, target);
+
+    int err = mtar_write_header(tar, &h);
     if(err)
-        die(E_TAR, "listing failed: %s", mtar_strerror(err));
+        die(E_TAR, "adding \"%s\" failed: %s", name, mtar_strerror(err));
 }
 
-struct extract_args {
-    char** names;
-    int count;
-};
-
-int extract_foreach_cb(mtar_t* tar, const mtar_header_t* h, void* arg)
+/* Copies 'len' bytes from the file's current position into the archive */
+void add_data(mtar_t* tar, int fd, unsigned len, const char* name)
 {
-    struct extract_args* args = arg;
-    (void)args; /* TODO */
+    static char iobuf[64 * 1024];
+    while(len > 0) {
+        unsigned n = len < sizeof(iobuf) ? len : sizeof(iobuf);
+        int rcount = read(fd, iobuf, n);
+        if(rcount < 0)
+            die(E_FS, "adding \"%s\" failed: %s", name, strerror(errno));
+        if(rcount == 0)
+            die(E_FS, "adding \"%s\" failed: file shrank while reading", name);
 
-    if(h->type == MTAR_TDIR) {
-        if(mkdir(h->name, h->mode) != 0)
-            die(E_FS, "cannot create directory \"%s\"", h->name);
-        return 0;
+        int wcount = mtar_write_data(tar, iobuf, rcount);
+        if(wcount < 0)
+            die(E_TAR, "adding \"%s\" failed: %s", name, mtar_strerror(wcount));
+        if(wcount != rcount)
+            die(E_TAR, "adding \"%s\" failed: write too short %d/%d", name, wcount, rcount);
+
+        len -= rcount;
     }
+}
 
-    if(h->type != MTAR_TREG) {
-        fprintf(stderr, "warning: not extracting unsupported type \"%s\"", h->name);
+/* Finds the data extents of a file with holes. Returns the number of
+ * extents, or zero if the file should be stored whole. */
+int find_extents(int fd, const struct stat* st, mtar_sparse_t** mapp)
+{
+#ifdef SEEK_DATA
+    /* only bother looking if some of the file isn't allocated */
+    if((off_t)st->st_blocks * 512 >= st->st_size)
         return 0;
+
+    mtar_sparse_t* map = NULL;
+    int count = 0, alloc = 0;
+    off_t pos = 0;
+    while(pos < st->st_size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if(data < 0 && errno == ENXIO)
+            break;
+
+        off_t hole = data < 0 ? data : lseek(fd, data, SEEK_HOLE);
+        if(hole < 0) {
+            /* the filesystem can't report holes */
+            free(map);
+            return 0;
+        }
+
+        if(count == alloc) {
+            alloc = alloc ? 2 * alloc : 16;
+            map = xrealloc(map, alloc * sizeof(mtar_sparse_t));
+        }
+
+        map[count].offset = data;
+        map[count].size = hole - data;
+        ++count;
+        pos = hole;
     }
 
-    int fd = open(h->name, O_CREAT|O_WRONLY|O_TRUNC, h->mode);
-    if(fd < 0)
-        die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+    /* end the map at the end of the file, like GNU tar does, so readers
+     * that ignore the real size still recreate a file of the right size */
+    if(count == 0 || map[count-1].offset + map[count-1].size < st->st_size) {
+        if(count == alloc)
+            map = xrealloc(map, (alloc + 1) * sizeof(mtar_sparse_t));
 
-    char iobuf[1024];
-    while(!mtar_eof_data(tar)) {
-        int rcount = mtar_read_data(tar, iobuf, sizeof(iobuf));
-        if(rcount < 0)
-            die(E_TAR, "extracting \"%s\" failed: %s", h->name, mtar_strerror(rcount));
+        map[count].offset = st->st_size;
+        map[count].size = 0;
+        ++count;
+    }
 
-        int wcount = write(fd, iobuf, rcount);
-        if(wcount != rcount)
-            die(E_FS, "extracting \"%s\" failed: %s", h->name, strerror(errno));
+    if(lseek(fd, 0, SEEK_SET) < 0) {
+        free(map);
+        return 0;
     }
 
-    close(fd);
+    *mapp = map;
+    return count;
+#else
+    (void)fd;
+    (void)st;
+    (void)mapp;
     return 0;
+#endif
 }
 
-void extract_files(mtar_t* tar, char** files, int num_files)
+struct add_state {
+    mtar_t* tar;
+    struct hash_table links;        /* of struct link_entry */
+    struct hash_table contents;     /* of struct content_entry */
+    const char* path;       /* member name of the entry being added */
+};
+
+void add_file(struct add_state* s, int fd, const struct stat* st)
 {
-    struct extract_args args;
-    args.names = files;
-    args.count = num_files;
+    mtar_t* tar = s->tar;
+    const char* path = s->path;
 
-    int err = mtar_foreach(tar, extract_foreach_cb, &args);
+    /* the size comes from stat so the header is written once and never
+     * has to be revisited, which allows streaming output */
+    if(st->st_size > UINT_MAX)
+        die(E_TAR, "adding \"%s\" failed: file too large", path);
+
+    /* later hard links to a file are stored as links to the first one,
+     * which only works when both names fit in the header */
+    const char* target = NULL;
+    if(st->st_nlink > 1 && strlen(path) <= 100)
+        target = link_find_or_add(&s->links, st, path);
+
+    /* identical files can also be stored as hard links */
+    if(!target && options.dedup && st->st_size > 0 && strlen(path) <= 100)
+        target = content_find_or_add(&s->contents, fd, st, path);
+
+    /* files with holes only store their data extents */
+    mtar_sparse_t* map = NULL;
+    int count = target ? 0 : find_extents(fd, st, &map);
+    int err;
+    if(target) {
+        add_link(tar, path, target, st);
+    } else if(count > 0) {
+        mtar_header_t h;
+        fill_header(&h, path, st, MTAR_TREG);
+        h.size = st->st_size;
+
+        err = mtar_write_sparse_header(tar, &h, map, count);
+        if(err)
+            die(E_TAR, "adding \"%s\" failed: %s", path, mtar_strerror(err));
+
+        for(int j = 0; j < count; ++j) {
+            if(lseek(fd, map[j].offset, SEEK_SET) < 0)
+                die(E_FS, "adding \"%s\" failed: %s", path, strerror(errno));
+
+            add_data(tar, fd, map[j].size, path);
+        }
+
+        free(map);
+    } else {
+        mtar_header_t h;
+        fill_header(&h, path, st, MTAR_TREG);
+        h.size = st->st_size;
+
+        err = mtar_write_header(tar, &h);
+        if(err)
+            die(E_TAR, "adding \"%s\" failed: %s", path, mtar_strerror(err));
+
+        add_data(tar, fd, st->st_size, path);
+    }
+
+    err = mtar_end_data(tar);
     if(err)
-        die(E_TAR, "extraction failed: %s", mtar_strerror(err));
+        die(E_TAR, "adding \"%s\" failed: %s", path, mtar_strerror(err));
 }
 
-void add_files(mtar_t* tar, char** files, int num_files)
+void add_symlink(struct add_state* s, const char* target, const struct stat* st)
 {
-    for(int i = 0; i < num_files; ++i) {
-        int fd = open(files[i], O_RDONLY);
-        if(fd < 0)
-            die(E_FS, "adding \"%s\" failed: %s", files[i], strerror(errno));
+    mtar_header_t h;
+    fill_header(&h, s->path, st, MTAR_TSYM);
+    strcpy(h.linkname, target);
+
+    int err = mtar_write_header(s->tar, &h);
+    if(err)
+        die(E_TAR, "adding \"%s\" failed: %s", s->path, mtar_strerror(err));
+}
 
-        off_t off = lseek(fd, 0, SEEK_END);
-        if(off < 0)
-            die(E_FS, "adding \"%s\" failed: %s", files[i], strerror(errno));
+struct dir_entry {
+    size_t name;        /* offset of the name */
+    unsigned char type; /* DT_* type, or DT_UNKNOWN */
+    uint64_t ino;
+    uint64_t key;       /* position of the data on disk, for sorting */
+};
 
-        unsigned filesize = off;
-        lseek(fd, 0, SEEK_SET);
+struct dir_list {
+    char* names;        /* null terminated names, back to back */
+    size_t names_len;
+    size_t names_alloc;
+    struct dir_entry* entries;
+    size_t count;
+    size_t alloc;
+};
 
-        int err = mtar_write_file_header(tar, files[i], filesize);
-        if(err)
-            die(E_TAR, "adding \"%s\" failed: %s", files[i], mtar_strerror(err));
+void dir_list_add(struct dir_list* l, const char* name, size_t len,
+                  unsigned char type, uint64_t ino)
+{
+    /* the directory itself and its parent are never archived */
+    if(name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.')))
+        return;
+
+    if(l->names_len + len + 1 > l->names_alloc) {
+        while(l->names_len + len + 1 > l->names_alloc)
+            l->names_alloc = l->names_alloc ? 2 * l->names_alloc : 4096;
+        l->names = xrealloc(l->names, l->names_alloc);
+    }
+
+    if(l->count == l->alloc) {
+        l->alloc = l->alloc ? 2 * l->alloc : 64;
+        l->entries = xrealloc(l->entries, l->alloc * sizeof(struct dir_entry));
+    }
+
+    memcpy(&l->names[l->names_len], name, len + 1);
+    l->entries[l->count].name = l->names_len;
+    l->entries[l->count].type = type;
+    l->entries[l->count].ino = ino;
+    l->entries[l->count].key = 0;
+    l->count++;
+    l->names_len += len + 1;
+}
+
+#if defined(__linux__) && defined(SYS_getdents64)
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+int dtype_is_dir(unsigned char type)
+{
+    if(type == DT_UNKNOWN)
+        return -1;
+
+    return type == DT_DIR;
+}
+
+/* Reads all entries of a directory up front, so only one buffer is ever
+ * in use no matter how deep the tree is. Returns an errno value. */
+int read_dir(int fd, struct dir_list* l)
+{
+    memset(l, 0, sizeof(*l));
+
+#if defined(__linux__) && defined(SYS_getdents64)
+    /* large batches keep the number of system calls down */
+    static uint64_t dents[32 * 1024];
+    while(1) {
+        long count = syscall(SYS_getdents64, fd, dents, sizeof(dents));
+        if(count < 0)
+            return errno;
+        if(count == 0)
+            break;
+
+        for(long pos = 0; pos < count; ) {
+            struct linux_dirent64* d = (struct linux_dirent64*)((char*)dents + pos);
+            dir_list_add(l, d->d_name, strlen(d->d_name), d->d_type, d->d_ino);
+            pos += d->d_reclen;
+        }
+    }
+#else
+    DIR* dir = fdopendir(dup(fd));
+    if(!dir)
+        return errno;
+
+    struct dirent* d;
+    errno = 0;
+    while((d = readdir(dir))) {
+# ifdef _DIRENT_HAVE_D_TYPE
+        unsigned char type = d->d_type;
+# else
+        unsigned char type = DT_UNKNOWN;
+# endif
+        dir_list_add(l, d->d_name, strlen(d->d_name), type, d->d_ino);
+    }
+
+    int err = errno;
+    closedir(dir);
+    if(err)
+        return err;
+#endif
+
+    return 0;
+}
+
+/* Returns the physical position of the start of a file's data, or zero
+ * if it has none or the filesystem can't tell */
+uint64_t first_extent(int dirfd, const char* name)
+{
+    uint64_t pos = 0;
+
+#ifdef FS_IOC_FIEMAP
+    /* don't block opening a FIFO that was listed as an unknown type */
+    int fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_NONBLOCK|O_CLOEXEC);
+    if(fd < 0)
+        return 0;
+
+    union {
+        struct fiemap map;
+        char raw[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+    } u;
+
+    memset(&u, 0, sizeof(u));
+    u.map.fm_start = 0;
+    u.map.fm_length = FIEMAP_MAX_OFFSET;
+    u.map.fm_extent_count = 1;
 
-        char iobuf[1024];
-        while(1) {
-            int rcount = read(fd, iobuf, sizeof(iobuf));
-            if(rcount < 0)
-                die(E_FS, "adding \"%s\" failed: %s", files[i], strerror(errno));
-            if(rcount == 0)
-                break;
+    struct stat st;
+    if(!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+       !ioctl(fd, FS_IOC_FIEMAP, &u.map) && u.map.fm_mapped_extents > 0)
+        pos = u.map.fm_extents[0].fe_physical;
 
-            int wcount = mtar_write_data(tar, iobuf, rcount);
-            if(wcount < 0)
-                die(E_TAR, "adding \"%s\" failed: %s", files[i], mtar_strerror(wcount));
-            if(wcount != rcount)
-                die(E_TAR, "adding \"%s\" failed: write too short %d/%d", files[i], wcount, rcount);
+    close(fd);
+#else
+    (void)dirfd;
+    (void)name;
+#endif
+
+    return pos;
+}
+
+int dir_entry_cmp(const void* a, const void* b)
+{
+    const struct dir_entry* ea = a;
+    const struct dir_entry* eb = b;
+    if(ea->key != eb->key)
+        return ea->key < eb->key ? -1 : 1;
+    if(ea->ino != eb->ino)
+        return ea->ino < eb->ino ? -1 : 1;
+
+    return (ea->name > eb->name) - (ea->name < eb->name);
+}
+
+/* Orders the entries of a directory so their data is read front to back
+ * on disk. Inode numbers are a cheap approximation of that. */
+void sort_dir(int fd, struct dir_list* l)
+{
+    if(options.sort == SORT_EXTENT) {
+        for(size_t i = 0; i < l->count; ++i) {
+            struct dir_entry* e = &l->entries[i];
+            if(e->type == DT_REG || e->type == DT_UNKNOWN)
+                e->key = first_extent(fd, &l->names[e->name]);
         }
+    }
+
+    qsort(l->entries, l->count, sizeof(struct dir_entry), dir_entry_cmp);
+}
+
+/* Creating an archive is split in three: a walker thread lists the
+ * directories, a pool of threads stats and opens the files, and the main
+ * thread writes the archive. Entries are passed along in order through a
+ * fixed ring of slots, so the writer only waits on metadata if the pool
+ * can't keep up, and the number of open files stays bounded. */
+#define PREFETCH_THREADS 8
+#define PREFETCH_SLOTS   128
+
+struct walk_dir {
+    int fd;
+    int refs;           /* slots still using the fd, under the ring lock */
+};
+
+struct walk_slot {
+    char path[PATH_MAX];    /* member name */
+    const char* name;       /* name relative to dir */
+    struct walk_dir* dir;   /* containing directory, or NULL for the cwd */
+    int ready;              /* set once the pool is done with the slot */
+    int err;                /* errno of the failed system call */
+    struct stat st;
+    int fd;                 /* open regular file */
+    char linkname[101];     /* target of a symbolic link */
+};
+
+struct prefetch {
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* slots were queued or the pool must stop */
+    pthread_cond_t ready;   /* a slot is ready or the walk has finished */
+    pthread_cond_t space;   /* a slot was freed */
+    struct walk_slot* slots;
+    unsigned head;          /* next slot to be queued by the walker */
+    unsigned claim;         /* next slot to be claimed by the pool */
+    unsigned tail;          /* next slot to be written out */
+    int walk_done;
+    int stop;
+    char** files;
+    int num_files;
+    char walk_path[PATH_MAX];
+    pthread_t walker;
+    pthread_t threads[PREFETCH_THREADS];
+};
+
+void dir_release(struct prefetch* p, struct walk_dir* dir)
+{
+    if(!dir)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    int refs = --dir->refs;
+    pthread_mutex_unlock(&p->lock);
+
+    if(refs == 0) {
+        close(dir->fd);
+        free(dir);
+    }
+}
+
+/* Queues the entry at p->walk_path. It is looked up in 'dir' by the last
+ * component of the path, starting at 'name_off', or by 'arg' if given. */
+void prefetch_queue(struct prefetch* p, struct walk_dir* dir, const char* arg,
+                    size_t name_off, int err)
+{
+    pthread_mutex_lock(&p->lock);
+    while(p->head - p->tail == PREFETCH_SLOTS)
+        pthread_cond_wait(&p->space, &p->lock);
+
+    struct walk_slot* slot = &p->slots[p->head % PREFETCH_SLOTS];
+    strcpy(slot->path, p->walk_path);
+    slot->name = arg ? arg : &slot->path[name_off];
+
+    slot->dir = dir;
+    if(dir)
+        dir->refs++;
+
+    slot->ready = 0;
+    slot->err = err;
+    slot->fd = -1;
+
+    p->head++;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+}
 
+void walk_dir(struct prefetch* p, struct walk_dir* parent, const char* name, size_t len)
+{
+    char* path = p->walk_path;
+    int fd = openat(parent ? parent->fd : AT_FDCWD, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC);
+    if(fd < 0) {
+        prefetch_queue(p, NULL, NULL, 0, errno);
+        return;
+    }
+
+    struct dir_list list;
+    int err = read_dir(fd, &list);
+    if(err) {
         close(fd);
+        prefetch_queue(p, NULL, NULL, 0, err);
+        return;
+    }
 
-        err = mtar_end_data(tar);
-        if(err)
-            die(E_TAR, "adding \"%s\" failed: %s", files[i], mtar_strerror(err));
+    if(options.sort != SORT_NONE)
+        sort_dir(fd, &list);
+
+    struct walk_dir* dir = xcalloc(1, sizeof(struct walk_dir));
+    dir->fd = fd;
+    dir->refs = 1;
+
+    /* the directory's member name already ends in a slash */
+    for(size_t i = 0; i < list.count; ++i) {
+        const char* child = &list.names[list.entries[i].name];
+        size_t child_len = strlen(child);
+        if(len + child_len + 1 >= sizeof(p->walk_path)) {
+            prefetch_queue(p, NULL, NULL, 0, ENAMETOOLONG);
+            continue;
+        }
+
+        memcpy(&path[len], child, child_len + 1);
+
+        int is_dir = dtype_is_dir(list.entries[i].type);
+        if(is_dir < 0) {
+            struct stat st;
+            is_dir = !fstatat(fd, child, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+        }
+
+        if(is_dir) {
+            path[len + child_len] = '/';
+            path[len + child_len + 1] = '\0';
+        }
+
+        prefetch_queue(p, dir, NULL, len, 0);
+        if(is_dir)
+            walk_dir(p, dir, &path[len], len + child_len + 1);
+    }
+
+    free(list.names);
+    free(list.entries);
+    dir_release(p, dir);
+}
+
+/* Queues a file named on the command line, and everything inside it if
+ * it's a directory */
+void walk_operand(struct prefetch* p, const char* file)
+{
+    char* path = p->walk_path;
+    size_t len = strip_slashes(file);
+    if(len + 1 >= sizeof(p->walk_path)) {
+        snprintf(path, sizeof(p->walk_path), "%s", file);
+        prefetch_queue(p, NULL, file, 0, ENAMETOOLONG);
+        return;
+    }
+
+    memcpy(path, file, len);
+    path[len] = '\0';
+
+    struct stat st;
+    int is_dir = !fstatat(AT_FDCWD, file, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+    if(is_dir && path[len - 1] != '/') {
+        path[len++] = '/';
+        path[len] = '\0';
+    }
+
+    prefetch_queue(p, NULL, file, 0, 0);
+    if(is_dir)
+        walk_dir(p, NULL, file, len);
+}
+
+/* Sorts the files named on the command line like the entries of a
+ * directory and queues them first, followed by the directories in the
+ * order they were given */
+void walk_sorted_operands(struct prefetch* p)
+{
+    struct dir_entry* order = xcalloc(p->num_files, sizeof(struct dir_entry));
+    size_t files = 0, dirs = p->num_files;
+
+    /* files fill the list from the front, directories from the back */
+    for(int i = 0; i < p->num_files; ++i) {
+        struct stat st;
+        int found = !fstatat(AT_FDCWD, p->files[i], &st, AT_SYMLINK_NOFOLLOW);
+        if(found && S_ISDIR(st.st_mode)) {
+            order[--dirs].name = i;
+            continue;
+        }
+
+        struct dir_entry* e = &order[files++];
+        e->name = i;
+        e->ino = found ? st.st_ino : 0;
+        if(options.sort == SORT_EXTENT && found && S_ISREG(st.st_mode))
+            e->key = first_extent(AT_FDCWD, p->files[i]);
+    }
+
+    qsort(order, files, sizeof(struct dir_entry), dir_entry_cmp);
+
+    for(size_t i = 0; i < files; ++i)
+        walk_operand(p, p->files[order[i].name]);
+    for(size_t i = p->num_files; i-- > dirs; )
+        walk_operand(p, p->files[order[i].name]);
+
+    free(order);
+}
+
+void* walker_main(void* arg)
+{
+    struct prefetch* p = arg;
+
+    if(options.sort != SORT_NONE) {
+        walk_sorted_operands(p);
+    } else {
+        for(int i = 0; i < p->num_files; ++i)
+            walk_operand(p, p->files[i]);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->walk_done = 1;
+    pthread_cond_broadcast(&p->ready);
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+void prefetch_slot(struct walk_slot* slot)
+{
+    int dirfd = slot->dir ? slot->dir->fd : AT_FDCWD;
+    if(slot->err)
+        return;
+
+    if(fstatat(dirfd, slot->name, &slot->st, AT_SYMLINK_NOFOLLOW) != 0) {
+        slot->err = errno;
+    } else if(S_ISREG(slot->st.st_mode)) {
+        slot->fd = openat(dirfd, slot->name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+        if(slot->fd < 0)
+            slot->err = errno;
+    } else if(S_ISLNK(slot->st.st_mode)) {
+        ssize_t len = readlinkat(dirfd, slot->name, slot->linkname, sizeof(slot->linkname));
+        if(len < 0)
+            slot->err = errno;
+        else if(len >= (ssize_t)sizeof(slot->linkname))
+            slot->err = ENAMETOOLONG;
+        else
+            slot->linkname[len] = '\0';
+    }
+}
+
+void* prefetch_main(void* arg)
+{
+    struct prefetch* p = arg;
+
+    pthread_mutex_lock(&p->lock);
+    while(1) {
+        while(p->claim == p->head && !p->stop)
+            pthread_cond_wait(&p->work, &p->lock);
+        if(p->claim == p->head)
+            break;
+
+        struct walk_slot* slot = &p->slots[p->claim++ % PREFETCH_SLOTS];
+        pthread_mutex_unlock(&p->lock);
+
+        prefetch_slot(slot);
+        struct walk_dir* dir = slot->dir;
+        slot->dir = NULL;
+        dir_release(p, dir);
+
+        pthread_mutex_lock(&p->lock);
+        slot->ready = 1;
+        pthread_cond_broadcast(&p->ready);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+void prefetch_start(struct prefetch* p, char** files, int num_files)
+{
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->ready, NULL);
+    pthread_cond_init(&p->space, NULL);
+    p->slots = xcalloc(PREFETCH_SLOTS, sizeof(struct walk_slot));
+    p->files = files;
+    p->num_files = num_files;
+
+    int err = pthread_create(&p->walker, NULL, walker_main, p);
+    for(int i = 0; !err && i < PREFETCH_THREADS; ++i)
+        err = pthread_create(&p->threads[i], NULL, prefetch_main, p);
+    if(err)
+        die(E_OTHER, "cannot start threads: %s", strerror(err));
+}
+
+/* Returns the next entry in archive order, or NULL when there are none */
+struct walk_slot* prefetch_next(struct prefetch* p)
+{
+    pthread_mutex_lock(&p->lock);
+    while(p->tail == p->head ? !p->walk_done : !p->slots[p->tail % PREFETCH_SLOTS].ready)
+        pthread_cond_wait(&p->ready, &p->lock);
+
+    struct walk_slot* slot = NULL;
+    if(p->tail != p->head)
+        slot = &p->slots[p->tail % PREFETCH_SLOTS];
+
+    pthread_mutex_unlock(&p->lock);
+    return slot;
+}
+
+void prefetch_done(struct prefetch* p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->tail++;
+    pthread_cond_signal(&p->space);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void prefetch_stop(struct prefetch* p)
+{
+    pthread_join(p->walker, NULL);
+
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+
+    for(int i = 0; i < PREFETCH_THREADS; ++i)
+        pthread_join(p->threads[i], NULL);
+
+    free(p->slots);
+}
+
+void add_files(mtar_t* tar, char** files, int num_files)
+{
+    static struct prefetch p;
+    struct add_state s;
+    s.tar = tar;
+    hash_init(&s.links, 0);
+    if(options.dedup)
+        hash_init(&s.contents, 0);
+
+    prefetch_start(&p, files, num_files);
+
+    struct walk_slot* slot;
+    while((slot = prefetch_next(&p))) {
+        s.path = slot->path;
+        if(slot->err)
+            die(E_FS, "adding \"%s\" failed: %s", s.path, strerror(slot->err));
+
+        if(S_ISDIR(slot->st.st_mode)) {
+            mtar_header_t h;
+            fill_header(&h, s.path, &slot->st, MTAR_TDIR);
+
+            int err = mtar_write_header(tar, &h);
+            if(err)
+                die(E_TAR, "adding \"%s\" failed: %s", s.path, mtar_strerror(err));
+        } else if(S_ISLNK(slot->st.st_mode)) {
+            add_symlink(&s, slot->linkname, &slot->st);
+        } else if(S_ISREG(slot->st.st_mode)) {
+            add_file(&s, slot->fd, &slot->st);
+            close(slot->fd);
+        } else {
+            fprintf(stderr, "warning: not adding special file \"%s\"\n", s.path);
+        }
+
+        prefetch_done(&p);
     }
+
+    prefetch_stop(&p);
+    hash_free(&s.links);
+    if(options.dedup)
+        hash_free(&s.contents);
 }
 
 int main(int argc, char* argv[])
@@ -174,14 +1979,44 @@ int main(int argc, char* argv[])
 "  mtar list tar-file\n"
 "    List the members of the given tar archive, one filename per line.\n"
 "\n"
-"  mtar create tar-file members...\n"
-"  mtar add tar-file members...\n"
+"  mtar create [--dedup] [--sort=inode|extent] tar-file members...\n"
 "    Create a new tar archive from the files listed on the command line.\n"
+"    Directories are added along with everything inside them, and symbolic\n"
+"    links are stored as links.\n"
+"    If tar-file is '-' the archive is written to standard output.\n"
 "    WARNING: Any existing file at tar-file will be overwritten!\n"
 "\n"
-"  mtar extract tar-file [members...]\n"
+"  mtar add [--dedup] [--sort=inode|extent] tar-file members...\n"
+"    Append the files listed on the command line to the end of an existing\n"
+"    tar archive, which is created if it doesn't exist.\n"
+"\n"
+"    Files with several hard links are stored once, and the other names\n"
+"    become links to it. With --dedup, files with identical contents are\n"
+"    also stored once, as if they were hard links.\n"
+"\n"
+"    With --sort, the contents of each directory are added in the order\n"
+"    of their inode numbers, or of the position of their data on disk,\n"
+"    so the files are read mostly sequentially. Files named on the command\n"
+"    line are sorted the same way and added before any directories.\n"
+"\n"
+"  mtar extract [--preallocate] [--skip-unchanged[=content]]\n"
+"               tar-file [members...]\n"
 "    Extract the contents of the tar archive to the current directory.\n"
 "    If filenames are given, only the named members will be extracted.\n"
+"    Naming a directory extracts everything under it, and names may be\n"
+"    glob patterns (eg. '*.txt') which are matched against member names.\n"
+"    A hard link whose target isn't extracted gets a copy of its data.\n"
+"    With --preallocate, space for each file is reserved before its data\n"
+"    is written. The files are then fully allocated, rather than leaving\n"
+"    holes where the data is all zeros.\n"
+"    With --skip-unchanged, existing files with the same size and mtime as\n"
+"    in the archive are left alone. With --skip-unchanged=content, files of\n"
+"    the same size are compared byte for byte instead, and are left alone\n"
+"    if they are identical.\n"
+"\n"
+"  mtar cat tar-file members...\n"
+"    Write the contents of the named members to standard output, in the\n"
+"    order they appear in the archive. Names are matched as for extract.\n"
 "\n");
         exit(E_ARGS);
     }
@@ -191,12 +2026,34 @@ int main(int argc, char* argv[])
         op = OP_LIST;
     else if(!strcmp(*argv, "create"))
         op = OP_CREATE;
+    else if(!strcmp(*argv, "add"))
+        op = OP_ADD;
     else if(!strcmp(*argv, "extract"))
         op = OP_EXTRACT;
+    else if(!strcmp(*argv, "cat"))
+        op = OP_CAT;
     else
         die(E_ARGS, "invalid operation \"%s\"", *argv);
     ++argv, --argc;
 
+    while(argc > 0 && !strncmp(*argv, "--", 2)) {
+        if(!strcmp(*argv, "--dedup") && (op == OP_CREATE || op == OP_ADD))
+            options.dedup = 1;
+        else if(!strcmp(*argv, "--sort=inode") && (op == OP_CREATE || op == OP_ADD))
+            options.sort = SORT_INODE;
+        else if(!strcmp(*argv, "--sort=extent") && (op == OP_CREATE || op == OP_ADD))
+            options.sort = SORT_EXTENT;
+        else if(!strcmp(*argv, "--preallocate") && op == OP_EXTRACT)
+            options.preallocate = 1;
+        else if(!strcmp(*argv, "--skip-unchanged") && op == OP_EXTRACT)
+            options.skip_unchanged = SKIP_METADATA;
+        else if(!strcmp(*argv, "--skip-unchanged=content") && op == OP_EXTRACT)
+            options.skip_unchanged = SKIP_CONTENT;
+        else
+            die(E_ARGS, "invalid option \"%s\"", *argv);
+        ++argv, --argc;
+    }
+
     if(argc == 0)
         die(E_ARGS, "missing archive name");
     const char* archive_name = *argv;
@@ -204,13 +2061,39 @@ int main(int argc, char* argv[])
 
     if(op == OP_LIST && argc != 0)
         die(E_ARGS, "excess arguments on command line");
+    if(op == OP_CAT && argc == 0)
+        die(E_ARGS, "no members named");
 
     const char* mode = "rb";
     if(op == OP_CREATE)
         mode = "wb";
+    else if(op == OP_ADD)
+        mode = "ab";
 
     mtar_t tar;
-    int err = mtar_open(&tar, archive_name, mode);
+    int err = 0;
+    if(!strcmp(archive_name, "-")) {
+        if(op != OP_CREATE)
+            die(E_ARGS, "'-' can only be used as the archive name with create");
+
+        /* Writes to stdout go through one large buffer; the archive is
+         * written front to back and never seeks, so pipes work too. */
+        static char stdout_buf[1024 * 1024];
+        setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+        mtar_open_file(&tar, stdout, MTAR_WRITE);
+    } else if(!strcmp(mode, "rb")) {
+        /* Open the file here to keep its descriptor for cat_data() */
+        FILE* file = fopen(archive_name, mode);
+        if(file) {
+            archive_fd = fileno(file);
+            mtar_open_file(&tar, file, MTAR_READ);
+        } else {
+            err = MTAR_EOPENFAIL;
+        }
+    } else {
+        err = mtar_open(&tar, archive_name, mode);
+    }
+
     if(err)
         die(E_TAR, "can't open archive: %s", mtar_strerror(err));
 
@@ -223,7 +2106,12 @@ int main(int argc, char* argv[])
         extract_files(&tar, argv, argc);
         break;
 
+    case OP_CAT:
+        cat_files(&tar, argv, argc);
+        break;
+
     case OP_CREATE:
+    case OP_ADD:
         add_files(&tar, argv, argc);
         err = mtar_finalize(&tar);
         if(err)
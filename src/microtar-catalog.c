@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2021 Aidan MacDonald
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "microtar-catalog.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Each archive gets a Bloom filter of num_bits bits containing the names
+ * of its members. All filters have the same size and use the same hash
+ * functions, so they're stored bit-sliced: row N holds bit N of every
+ * archive's filter, with one bit per archive. A lookup hashes the name
+ * once and ANDs together num_hashes rows, leaving a bit set for each
+ * archive which may contain the name. Since most rows are mostly zero, a
+ * name which isn't present in any archive is rejected after touching only
+ * a few bytes of memory per archive.
+ *
+ * The filters only say which archives may contain a name. Each archive
+ * also has a name index, built from the same scan, which confirms the
+ * candidates and gives the position of the member, so a lookup never has
+ * to scan an archive.
+ */
+enum {
+    BITS_PER_NAME = 10,
+    NUM_HASHES = 7,
+    CHUNK_LEN = 64,
+};
+
+struct hash_pair {
+    unsigned h1;
+    unsigned h2;
+};
+
+static struct hash_pair hash_name(const char* name)
+{
+    /* 64-bit FNV-1a, split into two 32-bit halves for double hashing */
+    unsigned long long h = 14695981039346656037ull;
+    while(*name) {
+        h ^= (unsigned char)*name++;
+        h *= 1099511628211ull;
+    }
+
+    struct hash_pair p;
+    p.h1 = (unsigned)h;
+    p.h2 = (unsigned)(h >> 32) | 1;
+    return p;
+}
+
+static unsigned bit_index(const mtar_catalog_t* cat, struct hash_pair p,
+                          unsigned i)
+{
+    return (p.h1 + i * p.h2) & (cat->num_bits - 1);
+}
+
+int mtar_catalog_init(mtar_catalog_t* cat, unsigned names_per_archive)
+{
+    unsigned want = names_per_archive * BITS_PER_NAME;
+    if(names_per_archive > UINT_MAX / BITS_PER_NAME)
+        return MTAR_EOVERFLOW;
+
+    /* num_bits must stay a power of two that fits in an unsigned */
+    if(want > 1u << 31)
+        return MTAR_EOVERFLOW;
+
+    memset(cat, 0, sizeof(mtar_catalog_t));
+    cat->num_bits = 64;
+    while(cat->num_bits < want)
+        cat->num_bits *= 2;
+
+    cat->num_hashes = NUM_HASHES;
+    return MTAR_ESUCCESS;
+}
+
+void mtar_catalog_free(mtar_catalog_t* cat)
+{
+    unsigned i;
+
+    for(i = 0; i < cat->count; ++i)
+        mtar_index_free(&cat->indexes[i]);
+
+    free(cat->indexes);
+    free(cat->extra);
+    free(cat->rows);
+    memset(cat, 0, sizeof(mtar_catalog_t));
+}
+
+static int grow_rows(mtar_catalog_t* cat)
+{
+    unsigned old_bytes = cat->row_bytes;
+    unsigned new_bytes = old_bytes ? 2 * old_bytes : CHUNK_LEN;
+    unsigned char* rows;
+    unsigned i;
+
+    if(new_bytes > UINT_MAX / cat->num_bits)
+        return MTAR_EOVERFLOW;
+
+    rows = realloc(cat->rows, (size_t)new_bytes * cat->num_bits);
+    if(!rows)
+        return MTAR_ENOMEM;
+
+    /* spread the rows out, starting from the end so nothing is
+     * overwritten before it has been moved */
+    for(i = cat->num_bits; i-- > 0; ) {
+        memmove(&rows[(size_t)i * new_bytes],
+                &rows[(size_t)i * old_bytes], old_bytes);
+        memset(&rows[(size_t)i * new_bytes + old_bytes], 0,
+               new_bytes - old_bytes);
+    }
+
+    cat->rows = rows;
+    cat->row_bytes = new_bytes;
+    return MTAR_ESUCCESS;
+}
+
+static void set_bits(mtar_catalog_t* cat, unsigned id, const char* name)
+{
+    struct hash_pair p = hash_name(name);
+    unsigned char bit = 1u << (id % 8);
+    unsigned i;
+
+    for(i = 0; i < cat->num_hashes; ++i) {
+        size_t row = bit_index(cat, p, i);
+        cat->rows[row * cat->row_bytes + id / 8] |= bit;
+    }
+}
+
+int mtar_catalog_add_name(mtar_catalog_t* cat, unsigned id, const char* name)
+{
+    if(id >= cat->count)
+        return MTAR_EAPI;
+
+    cat->extra[id] = 1;
+    set_bits(cat, id, name);
+    return MTAR_ESUCCESS;
+}
+
+static int grow_archives(mtar_catalog_t* cat)
+{
+    unsigned alloc = cat->alloc ? 2 * cat->alloc : 16;
+    mtar_index_t* indexes;
+    unsigned char* extra;
+
+    if(alloc > UINT_MAX / sizeof(mtar_index_t))
+        return MTAR_EOVERFLOW;
+
+    indexes = realloc(cat->indexes, alloc * sizeof(mtar_index_t));
+    if(!indexes)
+        return MTAR_ENOMEM;
+    cat->indexes = indexes;
+
+    extra = realloc(cat->extra, alloc);
+    if(!extra)
+        return MTAR_ENOMEM;
+    cat->extra = extra;
+
+    cat->alloc = alloc;
+    return MTAR_ESUCCESS;
+}
+
+struct add_state {
+    mtar_catalog_t* cat;
+    unsigned id;
+};
+
+static int add_entry_cb(const mtar_entry_t* entry, void* arg)
+{
+    struct add_state* st = arg;
+    set_bits(st->cat, st->id, entry->name);
+    return 0;
+}
+
+int mtar_catalog_add(mtar_catalog_t* cat, mtar_t* tar, unsigned* id)
+{
+    struct add_state st;
+    int err;
+
+    if(cat->count / 8 >= cat->row_bytes && (err = grow_rows(cat)))
+        return err;
+    if(cat->count == cat->alloc && (err = grow_archives(cat)))
+        return err;
+
+    /* the filter is filled from the finished index, so an archive that
+     * fails to scan is never added and the ids stay contiguous */
+    err = mtar_index_build(&cat->indexes[cat->count], tar);
+    if(err)
+        return err;
+
+    st.cat = cat;
+    st.id = cat->count;
+    cat->extra[st.id] = 0;
+    cat->count++;
+    *id = st.id;
+
+    return mtar_index_list(&cat->indexes[st.id], "", add_entry_cb, &st);
+}
+
+int mtar_catalog_lookup(const mtar_catalog_t* cat, const char* name,
+                        mtar_catalog_cb cb, void* arg)
+{
+    struct hash_pair p = hash_name(name);
+    unsigned char acc[CHUNK_LEN];
+    unsigned used = (cat->count + 7) / 8;
+    unsigned base, i, j, n;
+    int err;
+
+    /* process the rows in chunks to keep the accumulator on the stack */
+    for(base = 0; base < used; base += CHUNK_LEN) {
+        n = used - base < CHUNK_LEN ? used - base : CHUNK_LEN;
+
+        for(i = 0; i < cat->num_hashes; ++i) {
+            size_t row = bit_index(cat, p, i);
+            const unsigned char* r = &cat->rows[row * cat->row_bytes + base];
+            if(i == 0)
+                memcpy(acc, r, n);
+            else
+                for(j = 0; j < n; ++j)
+                    acc[j] &= r[j];
+        }
+
+        for(j = 0; j < n; ++j) {
+            for(i = 0; acc[j] != 0; ++i, acc[j] >>= 1) {
+                unsigned id = (base + j) * 8 + i;
+                unsigned pos;
+
+                if(!(acc[j] & 1))
+                    continue;
+
+                /* rule out false positives with the archive's index; names
+                 * added by hand aren't in it, so they can't be confirmed */
+                if(mtar_index_find(&cat->indexes[id], name, &pos)) {
+                    if(!cat->extra[id])
+                        continue;
+                    pos = MTAR_NOPOS;
+                }
+
+                if((err = cb(id, pos, arg)))
+                    return err;
+            }
+        }
+    }
+
+    return MTAR_ESUCCESS;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2021 Aidan MacDonald
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef MICROTAR_CATALOG_H
+#define MICROTAR_CATALOG_H
+
+#include "microtar.h"
+#include "microtar-index.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mtar_catalog mtar_catalog_t;
+
+typedef int(*mtar_catalog_cb)(unsigned id, unsigned pos, void*);
+
+struct mtar_catalog {
+    unsigned char* rows;    /* Bit-sliced Bloom filters, one row per bit */
+    unsigned num_bits;      /* Bits in each archive's Bloom filter */
+    unsigned num_hashes;    /* Number of bits set per name */
+    unsigned count;         /* Number of archives */
+    unsigned row_bytes;     /* Allocated bytes in each row */
+    mtar_index_t* indexes;  /* Name index of each archive */
+    unsigned char* extra;   /* Nonzero if names were added by hand */
+    unsigned alloc;         /* Number of archives allocated */
+};
+
+int mtar_catalog_init(mtar_catalog_t* cat, unsigned names_per_archive);
+void mtar_catalog_free(mtar_catalog_t* cat);
+
+int mtar_catalog_add(mtar_catalog_t* cat, mtar_t* tar, unsigned* id);
+int mtar_catalog_add_name(mtar_catalog_t* cat, unsigned id, const char* name);
+
+int mtar_catalog_lookup(const mtar_catalog_t* cat, const char* name,
+                        mtar_catalog_cb cb, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
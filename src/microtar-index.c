@@ -0,0 +1,680 @@
+/*
+ * Copyright (c) 2021 Aidan MacDonald
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "microtar-index.h"
+#include "microtar-hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Names are sorted and front-coded in blocks of BLOCK_LEN entries. Each
+ * entry is stored as:
+ *
+ *   - 1 byte: length of the prefix shared with the previous entry
+ *   - 1 byte: length of the remaining suffix
+ *   - the suffix bytes
+ *   - base-128 varints: position / 512, size, mtime, mode, owner, group
+ *     and the link target (0 for none, otherwise offset + 1 of the target
+ *     in the interned string pool)
+ *   - 1 byte: member type
+ *
+ * The first entry in each block shares nothing with its predecessor so
+ * blocks can be decoded independently, which allows binary searching over
+ * the blocks and then scanning a single block linearly.
+ *
+ * Link targets are interned, so each distinct target is stored only once
+ * no matter how many members refer to it.
+ */
+enum {
+    BLOCK_LEN = 16,
+    NAME_MAX_LEN = 100,
+    NUM_VARINTS = 7,
+    MAX_ENTRY_LEN = 2 + NAME_MAX_LEN + 5*NUM_VARINTS + 1,
+};
+
+struct build_entry {
+    const char* name;
+    unsigned name_ref;
+    unsigned pos;
+    unsigned size;
+    unsigned mtime;
+    unsigned mode;
+    unsigned owner;
+    unsigned group;
+    unsigned link;
+    int type;
+};
+
+struct intern_table {
+    unsigned* slots;        /* Offset + 1 of each string in the pool */
+    unsigned mask;
+    unsigned used;
+    char* pool;
+    unsigned pool_size;
+    unsigned pool_alloc;
+};
+
+struct cursor {
+    const mtar_index_t* idx;
+    unsigned entry;         /* Index of the decoded entry */
+    unsigned off;           /* Offset of the next entry in idx->data */
+    mtar_entry_t e;         /* Decoded entry, e.name points to name */
+    char name[NAME_MAX_LEN + 1];
+};
+
+struct pos_list {
+    mtar_member_t* members;
+    unsigned count;
+    unsigned alloc;
+};
+
+static int grow(void** ptr, unsigned* alloc, unsigned need, size_t elem_size)
+{
+    if(need <= *alloc)
+        return MTAR_ESUCCESS;
+
+    unsigned n = *alloc ? *alloc : 64;
+    while(n < need)
+        n *= 2;
+
+    void* p = realloc(*ptr, n * elem_size);
+    if(!p)
+        return MTAR_ENOMEM;
+
+    *ptr = p;
+    *alloc = n;
+    return MTAR_ESUCCESS;
+}
+
+static unsigned put_varint(unsigned char* p, unsigned value)
+{
+    unsigned n = 0;
+    while(value >= 0x80) {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+
+    p[n++] = value;
+    return n;
+}
+
+static unsigned get_varint(const unsigned char* p, unsigned* value)
+{
+    unsigned n = 0, shift = 0, v = 0;
+    do {
+        v |= (unsigned)(p[n] & 0x7f) << shift;
+        shift += 7;
+    } while(p[n++] & 0x80);
+
+    *value = v;
+    return n;
+}
+
+static unsigned hash_string(const char* str)
+{
+    return mtar_hash_bytes(str, strlen(str));
+}
+
+static int intern_rehash(struct intern_table* it)
+{
+    unsigned size = it->mask ? 2 * (it->mask + 1) : 64;
+    unsigned* slots = calloc(size, sizeof(unsigned));
+    if(!slots)
+        return MTAR_ENOMEM;
+
+    for(unsigned i = 0; it->mask && i <= it->mask; ++i) {
+        if(!it->slots[i])
+            continue;
+
+        unsigned j = hash_string(&it->pool[it->slots[i] - 1]) & (size - 1);
+        while(slots[j])
+            j = (j + 1) & (size - 1);
+        slots[j] = it->slots[i];
+    }
+
+    free(it->slots);
+    it->slots = slots;
+    it->mask = size - 1;
+    return MTAR_ESUCCESS;
+}
+
+/* Returns offset + 1 of the string in the pool, or 0 for an empty string */
+static int intern(struct intern_table* it, const char* str, unsigned* ref)
+{
+    unsigned len = strlen(str) + 1;
+    unsigned i;
+    int err;
+
+    if(len == 1) {
+        *ref = 0;
+        return MTAR_ESUCCESS;
+    }
+
+    if(2 * (it->used + 1) > it->mask + 1 && (err = intern_rehash(it)))
+        return err;
+
+    for(i = hash_string(str) & it->mask; it->slots[i]; i = (i + 1) & it->mask) {
+        if(!strcmp(&it->pool[it->slots[i] - 1], str)) {
+            *ref = it->slots[i];
+            return MTAR_ESUCCESS;
+        }
+    }
+
+    if((err = grow((void**)&it->pool, &it->pool_alloc, it->pool_size + len, 1)))
+        return err;
+
+    memcpy(&it->pool[it->pool_size], str, len);
+    it->pool_size += len;
+    it->slots[i] = it->pool_size - len + 1;
+    it->used++;
+
+    *ref = it->slots[i];
+    return MTAR_ESUCCESS;
+}
+
+static int build_entry_cmp(const void* a, const void* b)
+{
+    const struct build_entry* ea = a;
+    const struct build_entry* eb = b;
+    int r = strcmp(ea->name, eb->name);
+    if(r)
+        return r;
+
+    return (ea->pos > eb->pos) - (ea->pos < eb->pos);
+}
+
+static unsigned encode_entry(unsigned char* p, const struct build_entry* e,
+                             const char* prev)
+{
+    unsigned n = 0, shared = 0;
+    size_t len = strlen(e->name);
+
+    if(prev)
+        while(e->name[shared] && e->name[shared] == prev[shared])
+            ++shared;
+
+    p[n++] = shared;
+    p[n++] = len - shared;
+    memcpy(&p[n], e->name + shared, len - shared);
+    n += len - shared;
+
+    n += put_varint(&p[n], e->pos / 512);
+    n += put_varint(&p[n], e->size);
+    n += put_varint(&p[n], e->mtime);
+    n += put_varint(&p[n], e->mode);
+    n += put_varint(&p[n], e->owner);
+    n += put_varint(&p[n], e->group);
+    n += put_varint(&p[n], e->link);
+    p[n++] = e->type;
+    return n;
+}
+
+static int encode(mtar_index_t* idx, const struct build_entry* entries,
+                  unsigned count)
+{
+    unsigned i, size = 0;
+
+    idx->num_blocks = (count + BLOCK_LEN - 1) / BLOCK_LEN;
+    idx->blocks = malloc(idx->num_blocks * sizeof(unsigned) + 1);
+    idx->data = malloc(count * MAX_ENTRY_LEN + 1);
+    if(!idx->blocks || !idx->data)
+        return MTAR_ENOMEM;
+
+    for(i = 0; i < count; ++i) {
+        const char* prev = NULL;
+        if(i % BLOCK_LEN == 0)
+            idx->blocks[i / BLOCK_LEN] = size;
+        else
+            prev = entries[i - 1].name;
+
+        size += encode_entry(&idx->data[size], &entries[i], prev);
+    }
+
+    /* give back the slack from the worst case allocation */
+    unsigned char* data = realloc(idx->data, size + 1);
+    if(data)
+        idx->data = data;
+
+    idx->count = count;
+    return MTAR_ESUCCESS;
+}
+
+int mtar_index_build(mtar_index_t* idx, mtar_t* tar)
+{
+    struct build_entry* entries = NULL;
+    struct intern_table names = {0};
+    struct intern_table links = {0};
+    unsigned count = 0, alloc = 0;
+    unsigned i;
+    int err;
+
+    memset(idx, 0, sizeof(mtar_index_t));
+
+    err = mtar_rewind(tar);
+    if(err)
+        return err;
+
+    /* the name pool may move as it grows, so the entries only store a
+     * reference to their name until all members have been scanned */
+    while((err = mtar_next(tar)) == MTAR_ESUCCESS) {
+        const mtar_header_t* h = mtar_get_header(tar);
+
+        if((err = grow((void**)&entries, &alloc, count + 1,
+                       sizeof(struct build_entry))))
+            goto out;
+
+        struct build_entry* e = &entries[count++];
+        if((err = intern(&names, h->name, &e->name_ref)))
+            goto out;
+
+        e->pos = mtar_tell_member(tar);
+        e->size = h->size;
+        e->mtime = h->mtime;
+        e->mode = h->mode;
+        e->owner = h->owner;
+        e->group = h->group;
+        e->type = h->type;
+
+        if((err = intern(&links, h->linkname, &e->link)))
+            goto out;
+    }
+
+    if(err != MTAR_ENULLRECORD)
+        goto out;
+
+    for(i = 0; i < count; ++i) {
+        unsigned ref = entries[i].name_ref;
+        entries[i].name = ref ? &names.pool[ref - 1] : "";
+    }
+
+    qsort(entries, count, sizeof(struct build_entry), build_entry_cmp);
+    err = encode(idx, entries, count);
+    if(err)
+        goto out;
+
+    /* the index keeps the link target pool */
+    idx->strings = links.pool;
+    links.pool = NULL;
+
+  out:
+    free(entries);
+    free(names.slots);
+    free(names.pool);
+    free(links.slots);
+    free(links.pool);
+    if(err)
+        mtar_index_free(idx);
+
+    return err;
+}
+
+void mtar_index_free(mtar_index_t* idx)
+{
+    free(idx->data);
+    free(idx->blocks);
+    free(idx->strings);
+    memset(idx, 0, sizeof(mtar_index_t));
+}
+
+static void cursor_seek_block(struct cursor* c, unsigned block)
+{
+    c->entry = block * BLOCK_LEN;
+    c->off = c->idx->blocks[block];
+}
+
+/* Decodes the entry at the cursor; returns 0 at the end of the index */
+static int cursor_decode(struct cursor* c)
+{
+    const unsigned char* p;
+    unsigned shared, suffix, n, link, type;
+
+    if(c->entry >= c->idx->count)
+        return 0;
+
+    p = &c->idx->data[c->off];
+    shared = p[0];
+    suffix = p[1];
+    memcpy(&c->name[shared], &p[2], suffix);
+    c->name[shared + suffix] = '\0';
+
+    n = 2 + suffix;
+    n += get_varint(&p[n], &c->e.pos);
+    n += get_varint(&p[n], &c->e.size);
+    n += get_varint(&p[n], &c->e.mtime);
+    n += get_varint(&p[n], &c->e.mode);
+    n += get_varint(&p[n], &c->e.owner);
+    n += get_varint(&p[n], &c->e.group);
+    n += get_varint(&p[n], &link);
+    type = p[n++];
+
+    c->e.name = c->name;
+    c->e.linkname = link ? &c->idx->strings[link - 1] : "";
+    c->e.pos *= 512;
+    c->e.type = type;
+    c->off += n;
+    return 1;
+}
+
+static int cursor_next(struct cursor* c)
+{
+    ++c->entry;
+    return cursor_decode(c);
+}
+
+/* Positions the cursor at the first entry >= key */
+static int cursor_lower_bound(struct cursor* c, const mtar_index_t* idx,
+                              const char* key)
+{
+    unsigned lo = 0, hi, mid;
+    int ok;
+
+    c->idx = idx;
+    if(idx->count == 0) {
+        c->entry = 0;
+        return 0;
+    }
+
+    /* find the last block whose first name is < key */
+    hi = idx->num_blocks;
+    while(hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        cursor_seek_block(c, mid);
+        cursor_decode(c);
+        if(strcmp(c->name, key) < 0)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    cursor_seek_block(c, lo);
+    for(ok = cursor_decode(c); ok; ok = cursor_next(c))
+        if(strcmp(c->name, key) >= 0)
+            break;
+
+    return ok;
+}
+
+static int pos_list_add(struct pos_list* list, unsigned pos,
+                        mtar_foreach_cb cb, void* arg)
+{
+    int err = grow((void**)&list->members, &list->alloc, list->count + 1,
+                   sizeof(mtar_member_t));
+    if(err)
+        return err;
+
+    mtar_member_t* m = &list->members[list->count++];
+    m->name = NULL;
+    m->pos = pos;
+    m->cb = cb;
+    m->arg = arg;
+    return MTAR_ESUCCESS;
+}
+
+static int pos_list_visit(struct pos_list* list, mtar_t* tar)
+{
+    if(list->count == 0)
+        return MTAR_ESUCCESS;
+
+    int err = mtar_visit_members(tar, list->members, list->count);
+    free(list->members);
+    return err;
+}
+
+int mtar_index_find(const mtar_index_t* idx, const char* name, unsigned* pos)
+{
+    mtar_entry_t entry;
+    int err = mtar_index_find_entry(idx, name, &entry);
+    if(err)
+        return err;
+
+    *pos = entry.pos;
+    return MTAR_ESUCCESS;
+}
+
+int mtar_index_find_entry(const mtar_index_t* idx, const char* name,
+                          mtar_entry_t* entry)
+{
+    struct cursor c;
+
+    if(!cursor_lower_bound(&c, idx, name) || strcmp(c.name, name))
+        return MTAR_ENOTFOUND;
+
+    *entry = c.e;
+    entry->name = name;
+    return MTAR_ESUCCESS;
+}
+
+int mtar_index_list(const mtar_index_t* idx, const char* prefix,
+                    mtar_entry_cb cb, void* arg)
+{
+    struct cursor c;
+    size_t len = strlen(prefix);
+    int ok, err;
+
+    for(ok = cursor_lower_bound(&c, idx, prefix); ok; ok = cursor_next(&c)) {
+        if(strncmp(c.name, prefix, len))
+            break;
+        if((err = cb(&c.e, arg)))
+            return err;
+    }
+
+    return MTAR_ESUCCESS;
+}
+
+int mtar_index_prefix(const mtar_index_t* idx, mtar_t* tar, const char* prefix,
+                      mtar_foreach_cb cb, void* arg)
+{
+    struct pos_list list = {NULL, 0, 0};
+    struct cursor c;
+    size_t len = strlen(prefix);
+    int ok, err;
+
+    for(ok = cursor_lower_bound(&c, idx, prefix); ok; ok = cursor_next(&c)) {
+        if(strncmp(c.name, prefix, len))
+            break;
+        if((err = pos_list_add(&list, c.e.pos, cb, arg))) {
+            free(list.members);
+            return err;
+        }
+    }
+
+    return pos_list_visit(&list, tar);
+}
+
+int mtar_index_range(const mtar_index_t* idx, mtar_t* tar,
+                     const char* first, const char* last,
+                     mtar_foreach_cb cb, void* arg)
+{
+    struct pos_list list = {NULL, 0, 0};
+    struct cursor c;
+    int ok, err;
+
+    for(ok = cursor_lower_bound(&c, idx, first ? first : "");
+        ok; ok = cursor_next(&c)) {
+        if(last && strcmp(c.name, last) >= 0)
+            break;
+        if((err = pos_list_add(&list, c.e.pos, cb, arg))) {
+            free(list.members);
+            return err;
+        }
+    }
+
+    return pos_list_visit(&list, tar);
+}
+
+static int table_grow(mtar_table_t* t)
+{
+    void** columns[] = {
+        (void**)&t->size, (void**)&t->mtime, (void**)&t->mode,
+        (void**)&t->type, (void**)&t->pos, (void**)&t->name,
+    };
+    const size_t elem_sizes[] = {
+        sizeof(unsigned), sizeof(unsigned), sizeof(unsigned),
+        1, sizeof(unsigned), sizeof(unsigned),
+    };
+    unsigned alloc = t->alloc;
+    int err;
+
+    /* all columns share the same allocated length */
+    for(unsigned i = 0; i < sizeof(columns)/sizeof(columns[0]); ++i) {
+        alloc = t->alloc;
+        err = grow(columns[i], &alloc, t->count + 1, elem_sizes[i]);
+        if(err)
+            return err;
+    }
+
+    t->alloc = alloc;
+    return MTAR_ESUCCESS;
+}
+
+static int table_add(mtar_table_t* t, const mtar_header_t* h, unsigned pos)
+{
+    unsigned len = strlen(h->name) + 1;
+    int err;
+
+    if((err = table_grow(t)))
+        return err;
+    if((err = grow((void**)&t->names, &t->names_alloc, t->names_size + len, 1)))
+        return err;
+
+    unsigned i = t->count++;
+    t->size[i] = h->size;
+    t->mtime[i] = h->mtime;
+    t->mode[i] = h->mode;
+    t->type[i] = h->type;
+    t->pos[i] = pos;
+    t->name[i] = t->names_size;
+
+    memcpy(&t->names[t->names_size], h->name, len);
+    t->names_size += len;
+    return MTAR_ESUCCESS;
+}
+
+int mtar_table_build(mtar_table_t* table, mtar_t* tar)
+{
+    int err;
+
+    memset(table, 0, sizeof(mtar_table_t));
+
+    err = mtar_rewind(tar);
+    if(err)
+        return err;
+
+    while((err = mtar_next(tar)) == MTAR_ESUCCESS) {
+        err = table_add(table, mtar_get_header(tar), mtar_tell_member(tar));
+        if(err)
+            break;
+    }
+
+    if(err == MTAR_ENULLRECORD)
+        return MTAR_ESUCCESS;
+
+    mtar_table_free(table);
+    return err;
+}
+
+void mtar_table_free(mtar_table_t* table)
+{
+    free(table->size);
+    free(table->mtime);
+    free(table->mode);
+    free(table->type);
+    free(table->pos);
+    free(table->name);
+    free(table->names);
+    memset(table, 0, sizeof(mtar_table_t));
+}
+
+const char* mtar_table_name(const mtar_table_t* table, unsigned i)
+{
+    return &table->names[table->name[i]];
+}
+
+/*
+ * The filters below are written as simple branch-free loops over a single
+ * column so that the compiler can vectorize them.
+ */
+
+void mtar_table_select_all(const mtar_table_t* table, unsigned char* sel)
+{
+    memset(sel, 1, table->count);
+}
+
+void mtar_table_filter_newer(const mtar_table_t* table, unsigned mtime,
+                             unsigned char* sel)
+{
+    const unsigned* col = table->mtime;
+    for(unsigned i = 0; i < table->count; ++i)
+        sel[i] &= (col[i] > mtime);
+}
+
+void mtar_table_filter_older(const mtar_table_t* table, unsigned mtime,
+                             unsigned char* sel)
+{
+    const unsigned* col = table->mtime;
+    for(unsigned i = 0; i < table->count; ++i)
+        sel[i] &= (col[i] < mtime);
+}
+
+void mtar_table_filter_larger(const mtar_table_t* table, unsigned size,
+                              unsigned char* sel)
+{
+    const unsigned* col = table->size;
+    for(unsigned i = 0; i < table->count; ++i)
+        sel[i] &= (col[i] > size);
+}
+
+void mtar_table_filter_type(const mtar_table_t* table, int type,
+                            unsigned char* sel)
+{
+    const unsigned char* col = table->type;
+    for(unsigned i = 0; i < table->count; ++i)
+        sel[i] &= (col[i] == type);
+}
+
+void mtar_table_filter_mode(const mtar_table_t* table, unsigned mask,
+                            unsigned value, unsigned char* sel)
+{
+    const unsigned* col = table->mode;
+    for(unsigned i = 0; i < table->count; ++i)
+        sel[i] &= ((col[i] & mask) == value);
+}
+
+unsigned mtar_table_count(const mtar_table_t* table, const unsigned char* sel)
+{
+    unsigned n = 0;
+    for(unsigned i = 0; i < table->count; ++i)
+        n += sel[i];
+
+    return n;
+}
+
+unsigned long long mtar_table_total_size(const mtar_table_t* table,
+                                         const unsigned char* sel)
+{
+    const unsigned* col = table->size;
+    unsigned long long total = 0;
+    for(unsigned i = 0; i < table->count; ++i)
+        total += col[i] & -(unsigned)sel[i];
+
+    return total;
+}
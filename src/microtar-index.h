@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2021 Aidan MacDonald
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef MICROTAR_INDEX_H
+#define MICROTAR_INDEX_H
+
+#include "microtar.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mtar_index mtar_index_t;
+typedef struct mtar_table mtar_table_t;
+typedef struct mtar_entry mtar_entry_t;
+
+typedef int(*mtar_entry_cb)(const mtar_entry_t*, void*);
+
+struct mtar_entry {
+    const char* name;       /* Member name */
+    const char* linkname;   /* Link target, empty if none */
+    unsigned pos;           /* Header position */
+    unsigned size;
+    unsigned mtime;
+    unsigned mode;
+    unsigned owner;
+    unsigned group;
+    int type;
+};
+
+struct mtar_index {
+    unsigned char* data;    /* Front-coded names and packed metadata */
+    unsigned* blocks;       /* Offset of each block of entries in data */
+    char* strings;          /* Interned link targets */
+    unsigned num_blocks;    /* Number of blocks */
+    unsigned count;         /* Number of entries */
+};
+
+struct mtar_table {
+    unsigned* size;         /* Member sizes */
+    unsigned* mtime;        /* Modification times */
+    unsigned* mode;         /* File modes */
+    unsigned char* type;    /* Member types */
+    unsigned* pos;          /* Header positions */
+    unsigned* name;         /* Offset of each name in the string pool */
+    char* names;            /* String pool holding the member names */
+    unsigned count;         /* Number of members */
+    unsigned alloc;         /* Number of members allocated */
+    unsigned names_size;    /* Bytes used in the string pool */
+    unsigned names_alloc;   /* Bytes allocated for the string pool */
+};
+
+int mtar_index_build(mtar_index_t* idx, mtar_t* tar);
+void mtar_index_free(mtar_index_t* idx);
+
+int mtar_index_find(const mtar_index_t* idx, const char* name, unsigned* pos);
+int mtar_index_find_entry(const mtar_index_t* idx, const char* name,
+                          mtar_entry_t* entry);
+int mtar_index_list(const mtar_index_t* idx, const char* prefix,
+                    mtar_entry_cb cb, void* arg);
+int mtar_index_prefix(const mtar_index_t* idx, mtar_t* tar, const char* prefix,
+                      mtar_foreach_cb cb, void* arg);
+int mtar_index_range(const mtar_index_t* idx, mtar_t* tar,
+                     const char* first, const char* last,
+                     mtar_foreach_cb cb, void* arg);
+
+int mtar_table_build(mtar_table_t* table, mtar_t* tar);
+void mtar_table_free(mtar_table_t* table);
+const char* mtar_table_name(const mtar_table_t* table, unsigned i);
+
+void mtar_table_select_all(const mtar_table_t* table, unsigned char* sel);
+void mtar_table_filter_newer(const mtar_table_t* table, unsigned mtime,
+                             unsigned char* sel);
+void mtar_table_filter_older(const mtar_table_t* table, unsigned mtime,
+                             unsigned char* sel);
+void mtar_table_filter_larger(const mtar_table_t* table, unsigned size,
+                              unsigned char* sel);
+void mtar_table_filter_type(const mtar_table_t* table, int type,
+                            unsigned char* sel);
+void mtar_table_filter_mode(const mtar_table_t* table, unsigned mask,
+                            unsigned value, unsigned char* sel);
+unsigned mtar_table_count(const mtar_table_t* table, const unsigned char* sel);
+unsigned long long mtar_table_total_size(const mtar_table_t* table,
+                                         const unsigned char* sel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,6 +24,7 @@
 #include "microtar-stdio.h"
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 
 static int file_read(void* stream, void* data, unsigned size)
 {
@@ -62,13 +63,23 @@ static const mtar_ops_t file_ops = {
     .close = file_close,
 };
 
+void mtar_open_file(mtar_t* tar, FILE* file, int access)
+{
+    mtar_init(tar, access, &file_ops, file);
+}
+
 int mtar_open(mtar_t* tar, const char* filename, const char* mode)
 {
     /* Determine access mode */
     int access;
     char* read = strchr(mode, 'r');
     char* write = strchr(mode, 'w');
-    if(read) {
+    char* append = strchr(mode, 'a');
+    if(append) {
+        if(read || write)
+            return MTAR_EAPI;
+        access = MTAR_READ;
+    } else if(read) {
         if(write)
             return MTAR_EAPI;
         access = MTAR_READ;
@@ -78,11 +89,29 @@ int mtar_open(mtar_t* tar, const char* filename, const char* mode)
         return MTAR_EAPI;
     }
 
-    /* Open file */
-    FILE* file = fopen(filename, mode);
+    /* Open file; appending needs to read the existing archive and then
+     * overwrite its null records, so use an update mode for it */
+    FILE* file;
+    if(append) {
+        file = fopen(filename, "r+b");
+        if(!file && errno == ENOENT)
+            file = fopen(filename, "w+b");
+    } else {
+        file = fopen(filename, mode);
+    }
+
     if(!file)
         return MTAR_EOPENFAIL;
 
-    mtar_init(tar, access, &file_ops, file);
+    mtar_open_file(tar, file, access);
+
+    if(append) {
+        int err = mtar_append(tar);
+        if(err) {
+            mtar_close(tar);
+            return err;
+        }
+    }
+
     return MTAR_ESUCCESS;
 }
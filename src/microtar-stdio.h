@@ -25,12 +25,14 @@
 #define MICROTAR_STDIO_H
 
 #include "microtar.h"
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int mtar_open(mtar_t* tar, const char* filename, const char* mode);
+void mtar_open_file(mtar_t* tar, FILE* file, int access);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,313 @@
+/*
+ * Copyright (c) 2021 Aidan MacDonald
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include "microtar-union.h"
+#include "microtar-hash.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The merged namespace is a hash table keyed by normalized member name
+ * (without any leading "./" or trailing "/"), built by scanning the layers
+ * from the bottom up so that later layers replace the entries of earlier
+ * ones. Whiteouts follow the conventions used by container image layers:
+ *
+ *   - "dir/.wh.name" deletes "dir/name", and anything under it, from the
+ *     layers below.
+ *   - "dir/.wh..wh..opq" makes "dir" opaque, deleting everything under it
+ *     from the layers below but keeping the directory itself.
+ *
+ * Whiteouts are recorded against the name they delete rather than applied
+ * to the table immediately, so deleting a whole directory tree costs O(1).
+ * They are checked at lookup time by walking the parent directories.
+ *
+ * Layer numbers are stored offset by one, so that zero means "none".
+ */
+struct mtar_union_slot {
+    unsigned name;          /* Offset + 1 of the name in the pool, 0 if free */
+    unsigned hash;          /* Hash of the name */
+    unsigned pos;           /* Header position of the member */
+    unsigned layer;         /* Layer holding the member */
+    unsigned hidden;        /* Topmost layer with a whiteout for the name */
+    unsigned opaque;        /* Topmost layer marking the directory opaque */
+    unsigned replaced;      /* Topmost layer with a non-directory member */
+    int dir;                /* Nonzero if the member is a directory */
+};
+
+static const char WHITEOUT[] = ".wh.";
+static const char OPAQUE[] = ".wh..wh..opq";
+
+enum {
+    NAME_MAX_LEN = 100,
+    WHITEOUT_LEN = sizeof(WHITEOUT) - 1,
+};
+
+static const char* normalize(const char* name, size_t* len)
+{
+    size_t n;
+
+    while(name[0] == '.' && name[1] == '/')
+        name += 2;
+    while(name[0] == '/')
+        ++name;
+
+    n = strlen(name);
+    while(n > 0 && name[n - 1] == '/')
+        --n;
+    if(n == 1 && name[0] == '.')
+        n = 0;
+
+    *len = n;
+    return name;
+}
+
+static struct mtar_union_slot* find_slot(const mtar_union_t* u,
+                                         const char* name, size_t len)
+{
+    unsigned hash = mtar_hash_bytes(name, len);
+    unsigned i = hash & u->mask;
+
+    for(; u->slots[i].name; i = (i + 1) & u->mask) {
+        struct mtar_union_slot* s = &u->slots[i];
+        const char* sname = &u->names[s->name - 1];
+        if(s->hash == hash && !strncmp(sname, name, len) && !sname[len])
+            return s;
+    }
+
+    return &u->slots[i];
+}
+
+static int rehash(mtar_union_t* u)
+{
+    unsigned size = u->mask ? 2 * (u->mask + 1) : 256;
+    struct mtar_union_slot* slots = calloc(size, sizeof(*slots));
+    unsigned i, j;
+
+    if(!slots)
+        return MTAR_ENOMEM;
+
+    for(i = 0; u->mask && i <= u->mask; ++i) {
+        if(!u->slots[i].name)
+            continue;
+
+        j = u->slots[i].hash & (size - 1);
+        while(slots[j].name)
+            j = (j + 1) & (size - 1);
+        slots[j] = u->slots[i];
+    }
+
+    free(u->slots);
+    u->slots = slots;
+    u->mask = size - 1;
+    return MTAR_ESUCCESS;
+}
+
+static int get_slot(mtar_union_t* u, const char* name, size_t len,
+                    struct mtar_union_slot** slot)
+{
+    struct mtar_union_slot* s;
+    int err;
+
+    if(2 * (u->count + 1) > u->mask + 1 && (err = rehash(u)))
+        return err;
+
+    s = find_slot(u, name, len);
+    if(!s->name) {
+        if(u->names_size + len + 1 > u->names_alloc) {
+            unsigned alloc = u->names_alloc ? 2 * u->names_alloc : 4096;
+            while(alloc < u->names_size + len + 1)
+                alloc *= 2;
+
+            char* names = realloc(u->names, alloc);
+            if(!names)
+                return MTAR_ENOMEM;
+
+            u->names = names;
+            u->names_alloc = alloc;
+        }
+
+        memcpy(&u->names[u->names_size], name, len);
+        u->names[u->names_size + len] = '\0';
+
+        s->name = u->names_size + 1;
+        s->hash = mtar_hash_bytes(name, len);
+        u->names_size += len + 1;
+        u->count++;
+    }
+
+    *slot = s;
+    return MTAR_ESUCCESS;
+}
+
+static int add_member(mtar_union_t* u, unsigned layer,
+                      const mtar_header_t* h, unsigned pos)
+{
+    struct mtar_union_slot* s;
+    char target[NAME_MAX_LEN + 1];
+    const char* name;
+    const char* base;
+    size_t len, dirlen, baselen;
+    int err;
+
+    name = normalize(h->name, &len);
+    for(base = name + len; base > name && base[-1] != '/'; --base);
+    dirlen = base > name ? (size_t)(base - name - 1) : 0;
+    baselen = name + len - base;
+
+    if(baselen == sizeof(OPAQUE) - 1 && !memcmp(base, OPAQUE, baselen)) {
+        if((err = get_slot(u, name, dirlen, &s)))
+            return err;
+
+        s->opaque = layer;
+    } else if(baselen > WHITEOUT_LEN && !memcmp(base, WHITEOUT, WHITEOUT_LEN)) {
+        /* remove the prefix from the last path component */
+        size_t prefix = base - name;
+        memcpy(target, name, prefix);
+        memcpy(&target[prefix], base + WHITEOUT_LEN, len - prefix - WHITEOUT_LEN);
+
+        if((err = get_slot(u, target, len - WHITEOUT_LEN, &s)))
+            return err;
+
+        s->hidden = layer;
+    } else {
+        if((err = get_slot(u, name, len, &s)))
+            return err;
+
+        s->layer = layer;
+        s->pos = pos;
+        s->dir = (h->type == MTAR_TDIR);
+        if(!s->dir)
+            s->replaced = layer;
+    }
+
+    return MTAR_ESUCCESS;
+}
+
+static int is_visible(const mtar_union_t* u, const struct mtar_union_slot* s)
+{
+    const char* name = &u->names[s->name - 1];
+    size_t i, len = strlen(name);
+
+    if(!s->layer || s->hidden > s->layer)
+        return 0;
+
+    /* check for parents which were deleted, made opaque or replaced by
+     * a non-directory in a higher layer; i == 0 checks the root. A parent
+     * replaced by a file hides everything below it, even if a later
+     * layer turns it back into a directory. */
+    for(i = 0; i < len; ++i) {
+        if(i != 0 && name[i] != '/')
+            continue;
+
+        const struct mtar_union_slot* p = find_slot(u, name, i);
+        if(!p->name)
+            continue;
+        if(p->hidden > s->layer || p->opaque > s->layer)
+            return 0;
+        if(i != 0 && p->replaced > s->layer)
+            return 0;
+    }
+
+    return 1;
+}
+
+int mtar_union_build(mtar_union_t* u, mtar_t* layers, unsigned num_layers)
+{
+    unsigned i;
+    int err;
+
+    memset(u, 0, sizeof(mtar_union_t));
+    u->layers = layers;
+    u->num_layers = num_layers;
+
+    if((err = rehash(u)))
+        return err;
+
+    for(i = 0; i < num_layers; ++i) {
+        mtar_t* tar = &layers[i];
+
+        err = mtar_rewind(tar);
+        while(!err && (err = mtar_next(tar)) == MTAR_ESUCCESS)
+            err = add_member(u, i + 1, mtar_get_header(tar),
+                             mtar_tell_member(tar));
+
+        if(err != MTAR_ENULLRECORD) {
+            mtar_union_free(u);
+            return err;
+        }
+    }
+
+    return MTAR_ESUCCESS;
+}
+
+void mtar_union_free(mtar_union_t* u)
+{
+    free(u->slots);
+    free(u->names);
+    memset(u, 0, sizeof(mtar_union_t));
+}
+
+int mtar_union_find(mtar_union_t* u, const char* name, unsigned* layer)
+{
+    size_t len;
+    name = normalize(name, &len);
+
+    const struct mtar_union_slot* s = find_slot(u, name, len);
+    if(!s->name || !is_visible(u, s))
+        return MTAR_ENOTFOUND;
+
+    *layer = s->layer - 1;
+    return mtar_seek_member(&u->layers[s->layer - 1], s->pos);
+}
+
+int mtar_union_foreach(mtar_union_t* u, mtar_foreach_cb cb, void* arg)
+{
+    mtar_member_t* members;
+    unsigned i, layer, count;
+    int err = MTAR_ESUCCESS;
+
+    members = malloc((u->count + 1) * sizeof(mtar_member_t));
+    if(!members)
+        return MTAR_ENOMEM;
+
+    /* visit the layers bottom up, each one in archive order */
+    for(layer = 1; layer <= u->num_layers && !err; ++layer) {
+        count = 0;
+        for(i = 0; i <= u->mask; ++i) {
+            const struct mtar_union_slot* s = &u->slots[i];
+            if(!s->name || s->layer != layer || !is_visible(u, s))
+                continue;
+
+            members[count].name = NULL;
+            members[count].pos = s->pos;
+            members[count].cb = cb;
+            members[count].arg = arg;
+            ++count;
+        }
+
+        if(count > 0)
+            err = mtar_visit_members(&u->layers[layer - 1], members, count);
+    }
+
+    free(members);
+    return err;
+}
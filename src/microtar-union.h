@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2021 Aidan MacDonald
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef MICROTAR_UNION_H
+#define MICROTAR_UNION_H
+
+#include "microtar.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mtar_union mtar_union_t;
+
+struct mtar_union_slot;
+
+struct mtar_union {
+    mtar_t* layers;         /* Archives, lowest layer first */
+    unsigned num_layers;    /* Number of layers */
+    struct mtar_union_slot* slots; /* Hash table of the merged namespace */
+    unsigned mask;          /* Hash table size - 1 */
+    unsigned count;         /* Number of names in the hash table */
+    char* names;            /* String pool holding the names */
+    unsigned names_size;    /* Bytes used in the string pool */
+    unsigned names_alloc;   /* Bytes allocated for the string pool */
+};
+
+int mtar_union_build(mtar_union_t* u, mtar_t* layers, unsigned num_layers);
+void mtar_union_free(mtar_union_t* u);
+
+int mtar_union_find(mtar_union_t* u, const char* name, unsigned* layer);
+int mtar_union_foreach(mtar_union_t* u, mtar_foreach_cb cb, void* arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
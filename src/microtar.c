@@ -23,6 +23,7 @@
 
 #include "microtar.h"
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 enum {
@@ -31,6 +32,8 @@ enum {
     S_WROTE_DATA     = 1 << 2,
     S_WROTE_DATA_EOF = 1 << 3,
     S_WROTE_FINALIZE = 1 << 4,
+    S_DEFERRED       = 1 << 5,  /* header not written yet, data is staged */
+    S_AUTO_SIZE      = 1 << 6,  /* size is set from the data written */
 };
 
 enum {
@@ -47,6 +50,27 @@ enum {
     HEADER_LEN   = 512,
 };
 
+/* Fields of the old GNU header used by sparse members */
+enum {
+    GNU_MAGIC_OFF  = 257,                       GNU_MAGIC_LEN = 8,
+    SPARSE_OFF     = 386,                       SPARSE_COUNT = 4,
+    ISEXTENDED_OFF = SPARSE_OFF+SPARSE_COUNT*24,
+    REALSIZE_OFF   = ISEXTENDED_OFF+1,          REALSIZE_LEN = 12,
+
+    /* extension records following the header hold more sparse entries */
+    EXT_SPARSE_COUNT   = 21,
+    EXT_ISEXTENDED_OFF = EXT_SPARSE_COUNT*24,
+
+    SPARSE_ENTRY_LEN   = 24,
+    SPARSE_FIELD_LEN   = 12,
+};
+
+#define GNU_MAGIC "ustar  "
+
+/* Deleted members are turned into pax extended headers with this name */
+#define TYPE_PAXHDR  'x'
+#define DELETED_NAME "././@Deleted"
+
 static int parse_octal(const char* str, size_t len, unsigned* ret)
 {
     unsigned n = 0;
@@ -201,7 +225,7 @@ static int raw_to_header(mtar_header_t* h, const char* raw)
     return MTAR_ESUCCESS;
 }
 
-static int header_to_raw(char* raw, const mtar_header_t* h)
+static int header_to_raw(char* raw, const mtar_header_t* h, unsigned* chksum_out)
 {
     unsigned chksum;
     int rc;
@@ -245,12 +269,143 @@ static int header_to_raw(char* raw, const mtar_header_t* h)
 
     raw[CHKSUM_OFF + CHKSUM_LEN - 1] = ' ';
 
+    if(chksum_out)
+        *chksum_out = chksum;
+
+    return MTAR_ESUCCESS;
+}
+
+static unsigned sum_bytes(const char* str, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)str;
+    unsigned sum = 0;
+    while(len-- > 0)
+        sum += *p++;
+
+    return sum;
+}
+
+static int is_deleted(const mtar_header_t* h)
+{
+    return h->type == TYPE_PAXHDR && !strcmp(h->name, DELETED_NAME);
+}
+
+static unsigned print_decimal(char* str, unsigned value)
+{
+    char tmp[10];
+    unsigned i, n = 0;
+
+    do {
+        tmp[n++] = '0' + (value % 10);
+        value /= 10;
+    } while(value > 0);
+
+    for(i = 0; i < n; ++i)
+        str[i] = tmp[n - i - 1];
+
+    return n;
+}
+
+static int write_at(mtar_t* tar, unsigned pos, const void* data, unsigned size)
+{
+    int err = tseek(tar, pos);
+    if(err)
+        return err;
+
+    int ret = twrite(tar, data, size);
+    if(ret < 0)
+        return ret;
+    if(ret != (int)size)
+        return MTAR_EWRITEFAIL;
+
     return MTAR_ESUCCESS;
 }
 
+/* Overwrites the 'len' bytes at 'pos' with a member that will be skipped by
+ * tar readers. It's a pax extended header holding a single comment record
+ * which covers all of its data, so only the start and end of the record
+ * need to be written -- the old contents in between become the comment. */
+static int write_tombstone(mtar_t* tar, unsigned pos, unsigned len)
+{
+    mtar_header_t h;
+    unsigned data_len = len - HEADER_LEN;
+    int err;
+
+    memset(&h, 0, sizeof(h));
+    h.mode = 0644;
+    h.size = data_len;
+    h.type = TYPE_PAXHDR;
+    strcpy(h.name, DELETED_NAME);
+
+    if(data_len > 0) {
+        char* rec = tar->buffer;
+        unsigned n = print_decimal(rec, data_len);
+        memcpy(&rec[n], " comment=", 9);
+        if((err = write_at(tar, pos + HEADER_LEN, rec, n + 9)))
+            return err;
+        if((err = write_at(tar, pos + len - 1, "\n", 1)))
+            return err;
+    }
+
+    if((err = header_to_raw(tar->buffer, &h, NULL)))
+        return err;
+
+    return write_at(tar, pos, tar->buffer, HEADER_LEN);
+}
+
+/* Returns 1 if there's nothing but deleted members from 'pos' up to the
+ * end of the archive, 0 if there's a live member, or an error. */
+static int only_deleted_from(mtar_t* tar, unsigned pos)
+{
+    mtar_header_t h;
+    int ret;
+
+    for(;;) {
+        if((ret = tseek(tar, pos)))
+            return ret;
+
+        /* the end of the stream counts as the end of the archive */
+        ret = tread(tar, tar->buffer, HEADER_LEN);
+        if(ret < 0)
+            return ret;
+        if(ret != HEADER_LEN)
+            return 1;
+
+        ret = raw_to_header(&h, tar->buffer);
+        if(ret == MTAR_ENULLRECORD)
+            return 1;
+        if(ret || !is_deleted(&h))
+            return 0;
+
+        pos += HEADER_LEN + round_up_512(h.size);
+    }
+}
+
+/* Frees the records from 'pos' to 'pos + len', returning 1 if the end of
+ * the archive was moved back to 'start' or 0 if a placeholder was written.
+ * A placeholder can't be the last member, since readers expect a pax header
+ * to be followed by the member it applies to, so the end of the archive is
+ * moved instead; 'start' can be earlier to take deleted members before
+ * 'pos' along with it. */
+static int free_records(mtar_t* tar, unsigned start, unsigned pos, unsigned len)
+{
+    int ret = only_deleted_from(tar, pos + len);
+    if(ret < 0)
+        return ret;
+    if(ret == 0)
+        return write_tombstone(tar, pos, len);
+
+    if((ret = tseek(tar, start)))
+        return ret;
+    if((ret = write_null_bytes(tar, 2 * HEADER_LEN)))
+        return ret;
+
+    return 1;
+}
+
 static unsigned data_beg_pos(const mtar_t* tar)
 {
-    return tar->header_pos + HEADER_LEN;
+    return tar->data_pos;
 }
 
 static unsigned data_end_pos(const mtar_t* tar)
@@ -269,7 +424,6 @@ static int ensure_header(mtar_t* tar)
         return MTAR_EOVERFLOW;
 
     tar->header_pos = tar->pos;
-    tar->end_pos = data_beg_pos(tar);
 
     ret = tread(tar, tar->buffer, HEADER_LEN);
     if(ret < 0)
@@ -281,6 +435,26 @@ static int ensure_header(mtar_t* tar)
     if(err)
         return err;
 
+    /* the data of sparse members comes after any extension records */
+    if(tar->header.type == MTAR_TSPARSE) {
+        int extended = tar->buffer[ISEXTENDED_OFF];
+        while(extended) {
+            if(tar->pos > UINT_MAX - HEADER_LEN)
+                return MTAR_EOVERFLOW;
+
+            ret = tread(tar, tar->buffer, HEADER_LEN);
+            if(ret < 0)
+                return ret;
+            if(ret != HEADER_LEN)
+                return MTAR_EREADFAIL;
+
+            extended = tar->buffer[EXT_ISEXTENDED_OFF];
+        }
+    }
+
+    tar->data_pos = tar->pos;
+    tar->deleted_pos = tar->header_pos;
+    tar->end_pos = tar->pos;
     if(tar->end_pos > UINT_MAX - tar->header.size)
         return MTAR_EOVERFLOW;
     tar->end_pos += tar->header.size;
@@ -307,6 +481,8 @@ const char* mtar_strerror(int err)
     case MTAR_ENAMETOOLONG: return "name too long";
     case MTAR_EWRONGSIZE:   return "wrong amount of data written";
     case MTAR_EACCESS:      return "wrong access mode";
+    case MTAR_ENOMEM:       return "out of memory";
+    case MTAR_ENOSPC:       return "not enough space";
     default:                return "unknown error";
     }
 }
@@ -364,14 +540,59 @@ int mtar_next(mtar_t* tar)
         return MTAR_EACCESS;
 #endif
 
-    if(tar->state & S_HEADER_VALID) {
-        tar->state &= ~S_HEADER_VALID;
+    unsigned deleted_pos = MTAR_NOPOS;
+    int err;
 
-        /* seek to the next header */
-        int err = tseek(tar, round_up_512(data_end_pos(tar)));
-        if(err)
-            return err;
-    }
+    do {
+        if(tar->state & S_HEADER_VALID) {
+            /* remember where the run of deleted members began, so deleting
+             * the member after it can move the end of the archive there */
+            if(deleted_pos == MTAR_NOPOS && is_deleted(&tar->header))
+                deleted_pos = tar->deleted_pos;
+
+            tar->state &= ~S_HEADER_VALID;
+
+            /* seek to the next header */
+            err = tseek(tar, round_up_512(data_end_pos(tar)));
+            if(err)
+                return err;
+        }
+
+        err = ensure_header(tar);
+    } while(!err && is_deleted(&tar->header));
+
+    if(!err && deleted_pos != MTAR_NOPOS)
+        tar->deleted_pos = deleted_pos;
+
+    return err;
+}
+
+unsigned mtar_tell_member(mtar_t* tar)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(!(tar->state & S_HEADER_VALID))
+        return MTAR_EAPI;
+#endif
+
+    return tar->header_pos;
+}
+
+int mtar_seek_member(mtar_t* tar, unsigned pos)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_READ)
+        return MTAR_EACCESS;
+#endif
+
+    /* headers always start on a record boundary */
+    if(pos & 511u)
+        return MTAR_ESEEKRANGE;
+
+    tar->state &= ~S_HEADER_VALID;
+
+    int err = tseek(tar, pos);
+    if(err)
+        return err;
 
     return ensure_header(tar);
 }
@@ -415,6 +636,172 @@ int mtar_find(mtar_t* tar, const char* name)
     return err;
 }
 
+/* Orders named members by name, followed by the others by position */
+static int member_cmp(const void* a, const void* b)
+{
+    const mtar_member_t* ma = (const mtar_member_t*)a;
+    const mtar_member_t* mb = (const mtar_member_t*)b;
+
+    if(ma->name && mb->name)
+        return strcmp(ma->name, mb->name);
+    if(ma->name || mb->name)
+        return ma->name ? -1 : 1;
+
+    return (ma->pos > mb->pos) - (ma->pos < mb->pos);
+}
+
+/* Sorts the members and returns how many have a name */
+static unsigned sort_members(mtar_member_t* members, unsigned count)
+{
+    unsigned i, named = 0;
+
+    for(i = 0; i < count; ++i) {
+        if(members[i].name) {
+            members[i].pos = MTAR_NOPOS;
+            ++named;
+        }
+    }
+
+    qsort(members, count, sizeof(mtar_member_t), member_cmp);
+    return named;
+}
+
+/* Returns the index of the first of the sorted named members which has
+ * the given name, or 'named' if there is none */
+static unsigned lookup_member(const mtar_member_t* members, unsigned named,
+                              const char* name)
+{
+    unsigned lo = 0, hi = named;
+
+    while(lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+        if(strcmp(members[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if(lo < named && strcmp(members[lo].name, name))
+        lo = named;
+
+    return lo;
+}
+
+/* Calls the member's callback on the current header. Several members can
+ * refer to the same header, so the data is rewound for all but the first. */
+static int call_member(mtar_t* tar, const mtar_member_t* m, int* visited)
+{
+    int err;
+
+    if(*visited && (err = mtar_seek_data(tar, 0, SEEK_SET)))
+        return err;
+
+    *visited = 1;
+    return m->cb(tar, &tar->header, m->arg);
+}
+
+/* Scans the archive once, resolving the named members. If 'visit' is set,
+ * the callbacks of named members are called as they are found, and those
+ * of members given by position when the scan reaches them. */
+static int scan_members(mtar_t* tar, mtar_member_t* members, unsigned count,
+                        unsigned named, int visit)
+{
+    unsigned i, next = named, remaining = named;
+    int err;
+
+    err = mtar_rewind(tar);
+    if(err)
+        return err;
+
+    while(remaining > 0 || (visit && next < count)) {
+        err = mtar_next(tar);
+        if(err)
+            break;
+
+        unsigned pos = tar->header_pos;
+        int visited = 0;
+
+        /* positions the scan stepped over, eg. of a member stored inside
+         * another member's data, are visited out of line */
+        for(; visit && next < count && members[next].pos <= pos; ++next) {
+            if(members[next].pos < pos) {
+                err = mtar_seek_member(tar, members[next].pos);
+                if(!err)
+                    err = members[next].cb(tar, &tar->header, members[next].arg);
+                if(!err)
+                    err = mtar_seek_member(tar, pos);
+            } else {
+                err = call_member(tar, &members[next], &visited);
+            }
+
+            if(err)
+                return err;
+        }
+
+        i = lookup_member(members, named, tar->header.name);
+        for(; i < named && !strcmp(members[i].name, tar->header.name); ++i) {
+            if(members[i].pos != MTAR_NOPOS)
+                continue;
+
+            members[i].pos = pos;
+            --remaining;
+
+            if(visit) {
+                err = call_member(tar, &members[i], &visited);
+                if(err)
+                    return err;
+            }
+        }
+    }
+
+    if(err && err != MTAR_ENULLRECORD)
+        return err;
+
+    /* positions past the end of the archive get the error from seeking */
+    for(; visit && next < count; ++next) {
+        err = mtar_seek_member(tar, members[next].pos);
+        if(!err)
+            err = members[next].cb(tar, &tar->header, members[next].arg);
+        if(err)
+            return err;
+    }
+
+    return remaining ? MTAR_ENOTFOUND : MTAR_ESUCCESS;
+}
+
+int mtar_find_members(mtar_t* tar, mtar_member_t* members, unsigned count)
+{
+    unsigned named = sort_members(members, count);
+    if(named == 0)
+        return MTAR_ESUCCESS;
+
+    /* names are looked up by binary search, which needs no extra memory */
+    return scan_members(tar, members, count, named, 0);
+}
+
+int mtar_visit_members(mtar_t* tar, mtar_member_t* members, unsigned count)
+{
+    unsigned i, named = sort_members(members, count);
+    int err;
+
+    if(named > 0)
+        return scan_members(tar, members, count, named, 1);
+
+    /* with only positions there is no need to scan, the members are
+     * sorted by position so the stream is only read forward */
+    for(i = 0; i < count; ++i) {
+        err = mtar_seek_member(tar, members[i].pos);
+        if(err)
+            return err;
+
+        err = members[i].cb(tar, &tar->header, members[i].arg);
+        if(err)
+            return err;
+    }
+
+    return MTAR_ESUCCESS;
+}
+
 int mtar_read_data(mtar_t* tar, void* ptr, unsigned size)
 {
 #ifndef MICROTAR_DISABLE_API_CHECKS
@@ -486,6 +873,16 @@ unsigned mtar_tell_data(mtar_t* tar)
     return tar->pos - data_beg_pos(tar);
 }
 
+unsigned mtar_data_offset(mtar_t* tar)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(!(tar->state & S_HEADER_VALID))
+        return MTAR_EAPI;
+#endif
+
+    return data_beg_pos(tar);
+}
+
 int mtar_eof_data(mtar_t* tar)
 {
     /* API usage error, but just claim EOF. */
@@ -495,86 +892,691 @@ int mtar_eof_data(mtar_t* tar)
     return tar->pos >= data_end_pos(tar) ? 1 : 0;
 }
 
-int mtar_write_header(mtar_t* tar, const mtar_header_t* h)
+/* Parses up to 'n' sparse entries from 'raw', storing them in the map
+ * while there is room in it. Returns nonzero once an unused entry is hit. */
+static int parse_sparse_entries(const char* raw, unsigned n,
+                                mtar_sparse_t* map, unsigned count,
+                                unsigned* total, int* err)
+{
+    unsigned i, offset, size;
+
+    for(i = 0; i < n; ++i, raw += SPARSE_ENTRY_LEN) {
+        if(raw[0] == '\0')
+            return 1;
+
+        if((*err = parse_octal(raw, SPARSE_FIELD_LEN, &offset)))
+            return 1;
+        if((*err = parse_octal(raw + SPARSE_FIELD_LEN, SPARSE_FIELD_LEN, &size)))
+            return 1;
+
+        if(*total < count) {
+            map[*total].offset = offset;
+            map[*total].size = size;
+        }
+
+        *total += 1;
+    }
+
+    return 0;
+}
+
+int mtar_read_sparse_map(mtar_t* tar, mtar_sparse_t* map, unsigned count,
+                         unsigned* realsize)
 {
 #ifndef MICROTAR_DISABLE_API_CHECKS
-    if(tar->access != MTAR_WRITE)
+    if(tar->access != MTAR_READ)
         return MTAR_EACCESS;
-    if(((tar->state & S_WROTE_DATA) && !(tar->state & S_WROTE_DATA_EOF)) ||
-       (tar->state & S_WROTE_FINALIZE))
+    if(!(tar->state & S_HEADER_VALID))
         return MTAR_EAPI;
 #endif
 
-    tar->state &= ~(S_HEADER_VALID | S_WROTE_HEADER |
-                    S_WROTE_DATA | S_WROTE_DATA_EOF);
-
-    /* ensure we have enough space to write the declared amount of data */
-    if(tar->pos > UINT_MAX - HEADER_LEN - round_up_512(h->size))
-        return MTAR_EOVERFLOW;
-
-    tar->header_pos = tar->pos;
-    tar->end_pos = data_beg_pos(tar);
+    if(tar->header.type != MTAR_TSPARSE)
+        return MTAR_EAPI;
 
-    if(h != &tar->header)
-        tar->header = *h;
+    unsigned old_pos = tar->pos, total = 0;
+    int ret, err = MTAR_ESUCCESS;
 
-    int err = header_to_raw(tar->buffer, &tar->header);
-    if(err)
+    /* the header itself was overwritten by any extension records */
+    if((err = tseek(tar, tar->header_pos)))
         return err;
 
-    int ret = twrite(tar, tar->buffer, HEADER_LEN);
+    ret = tread(tar, tar->buffer, HEADER_LEN);
     if(ret < 0)
         return ret;
     if(ret != HEADER_LEN)
-        return MTAR_EWRITEFAIL;
+        return MTAR_EREADFAIL;
 
-    tar->state |= (S_HEADER_VALID | S_WROTE_HEADER);
-    return MTAR_ESUCCESS;
-}
+    if(realsize) {
+        err = parse_octal(&tar->buffer[REALSIZE_OFF], REALSIZE_LEN, realsize);
+        if(err)
+            return err;
+    }
 
-int mtar_update_header(mtar_t* tar, const mtar_header_t* h)
-{
-#ifndef MICROTAR_DISABLE_API_CHECKS
-    if(tar->access != MTAR_WRITE)
-        return MTAR_EACCESS;
-    if(!(tar->state & S_WROTE_HEADER) ||
-       (tar->state & S_WROTE_DATA_EOF) ||
-       (tar->state & S_WROTE_FINALIZE))
-        return MTAR_EAPI;
-#endif
+    int done = parse_sparse_entries(&tar->buffer[SPARSE_OFF], SPARSE_COUNT,
+                                    map, count, &total, &err);
+    int extended = tar->buffer[ISEXTENDED_OFF];
 
-    unsigned beg_pos = data_beg_pos(tar);
-    if(beg_pos > UINT_MAX - h->size)
-        return MTAR_EOVERFLOW;
+    while(!done && !err && extended) {
+        ret = tread(tar, tar->buffer, HEADER_LEN);
+        if(ret < 0)
+            return ret;
+        if(ret != HEADER_LEN)
+            return MTAR_EREADFAIL;
+
+        done = parse_sparse_entries(tar->buffer, EXT_SPARSE_COUNT,
+                                    map, count, &total, &err);
+        extended = tar->buffer[EXT_ISEXTENDED_OFF];
+    }
 
-    unsigned old_pos = tar->pos;
-    int err = tseek(tar, tar->header_pos);
     if(err)
         return err;
+    if(total > INT_MAX)
+        return MTAR_EOVERFLOW;
+    if((err = tseek(tar, old_pos)))
+        return err;
 
-    if(h != &tar->header)
-        tar->header = *h;
+    return total;
+}
 
-    err = header_to_raw(tar->buffer, &tar->header);
-    if(err)
-        return err;
+/* Changes the size in the current member's header as it is stored in the
+ * archive. Only the size and checksum are touched, the checksum by adding
+ * the difference in the size field, so fields microtar doesn't parse such
+ * as the magic, user and group names and the ustar prefix are kept. */
+static int rewrite_raw_size(mtar_t* tar, unsigned new_size)
+{
+    char* raw = tar->buffer;
+    char size_field[SIZE_LEN];
+    unsigned chksum;
+    int ret;
 
-    int len = twrite(tar, tar->buffer, HEADER_LEN);
-    if(len < 0)
-        return len;
-    if(len != HEADER_LEN)
-        return MTAR_EWRITEFAIL;
+    if((ret = tseek(tar, tar->header_pos)))
+        return ret;
 
-    return tseek(tar, old_pos);
+    ret = tread(tar, raw, HEADER_LEN);
+    if(ret < 0)
+        return ret;
+    if(ret != HEADER_LEN)
+        return MTAR_EREADFAIL;
+
+    if((ret = parse_octal(&raw[CHKSUM_OFF], CHKSUM_LEN, &chksum)))
+        return ret;
+    if((ret = print_octal(size_field, SIZE_LEN, new_size)))
+        return ret;
+
+    chksum -= sum_bytes(&raw[SIZE_OFF], SIZE_LEN);
+    chksum += sum_bytes(size_field, SIZE_LEN);
+    memcpy(&raw[SIZE_OFF], size_field, SIZE_LEN);
+
+    if((ret = print_octal(&raw[CHKSUM_OFF], CHKSUM_LEN-1, chksum)))
+        return ret;
+
+    raw[CHKSUM_OFF + CHKSUM_LEN - 1] = ' ';
+    return write_at(tar, tar->header_pos, raw, HEADER_LEN);
 }
 
-int mtar_write_file_header(mtar_t* tar, const char* name, unsigned size)
+int mtar_replace_data(mtar_t* tar, const void* ptr, unsigned size)
 {
 #ifndef MICROTAR_DISABLE_API_CHECKS
-    if(tar->access != MTAR_WRITE)
+    if(tar->access != MTAR_READ)
         return MTAR_EACCESS;
-    if(((tar->state & S_WROTE_DATA) && !(tar->state & S_WROTE_DATA_EOF)) ||
-       (tar->state & S_WROTE_FINALIZE))
+    if(!(tar->state & S_HEADER_VALID))
+        return MTAR_EAPI;
+#endif
+
+    unsigned data_beg = data_beg_pos(tar);
+    unsigned old_len = round_up_512(tar->header.size);
+    unsigned new_len = round_up_512(size);
+    int err;
+
+    /* the new header would lose the sparse map */
+    if(tar->header.type == MTAR_TSPARSE)
+        return MTAR_EAPI;
+
+    if(size > old_len)
+        return MTAR_ENOSPC;
+
+    /* write the new data and pad it to the end of the record */
+    if((err = write_at(tar, data_beg, ptr, size)))
+        return err;
+    if((err = write_null_bytes(tar, new_len - size)))
+        return err;
+
+    /* turn any leftover records into a deleted member */
+    if(new_len < old_len) {
+        err = free_records(tar, data_beg + new_len, data_beg + new_len,
+                           old_len - new_len);
+        if(err < 0)
+            return err;
+    }
+
+    if((err = rewrite_raw_size(tar, size)))
+        return err;
+
+    tar->header.size = size;
+    tar->end_pos = data_beg + size;
+    return tseek(tar, data_beg);
+}
+
+int mtar_delete_member(mtar_t* tar)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_READ)
+        return MTAR_EACCESS;
+    if(!(tar->state & S_HEADER_VALID))
+        return MTAR_EAPI;
+#endif
+
+    unsigned len = round_up_512(data_end_pos(tar)) - tar->header_pos;
+    unsigned deleted_pos = tar->deleted_pos;
+    int err = free_records(tar, deleted_pos, tar->header_pos, len);
+    if(err < 0)
+        return err;
+
+    /* if the end of the archive was moved, mtar_next() will find it */
+    if(err == 1) {
+        tar->state &= ~S_HEADER_VALID;
+        tar->header_pos = deleted_pos;
+        return tseek(tar, deleted_pos);
+    }
+
+    /* load the tombstone, so mtar_next() will go on to the next member */
+    err = mtar_seek_member(tar, tar->header_pos);
+    tar->deleted_pos = deleted_pos;
+    return err;
+}
+
+static int move_data(mtar_t* tar, unsigned dst, unsigned src, unsigned len,
+                     void* buf, unsigned buf_size)
+{
+    int ret, err;
+
+    while(len > 0) {
+        unsigned n = len < buf_size ? len : buf_size;
+
+        if((err = tseek(tar, src)))
+            return err;
+
+        ret = tread(tar, buf, n);
+        if(ret < 0)
+            return ret;
+        if(ret != (int)n)
+            return MTAR_EREADFAIL;
+
+        if((err = write_at(tar, dst, buf, n)))
+            return err;
+
+        src += n;
+        dst += n;
+        len -= n;
+    }
+
+    return MTAR_ESUCCESS;
+}
+
+int mtar_compact(mtar_t* tar, void* buf, unsigned buf_size)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_READ)
+        return MTAR_EACCESS;
+#endif
+
+    unsigned dst = 0, src, len;
+    int err, found_hole = 0;
+
+    if(!buf || buf_size < HEADER_LEN) {
+        buf = tar->buffer;
+        buf_size = HEADER_LEN;
+    } else {
+        buf_size &= ~511u;
+    }
+
+    if((err = mtar_rewind(tar)))
+        return err;
+
+    /* members before the first deleted one stay where they are */
+    while((err = ensure_header(tar)) == MTAR_ESUCCESS) {
+        src = tar->header_pos;
+        len = round_up_512(data_end_pos(tar)) - src;
+
+        if(is_deleted(&tar->header)) {
+            if(!found_hole)
+                dst = src;
+            found_hole = 1;
+        } else if(found_hole) {
+            /* the header is moved along with the data; it does not
+             * depend on the member's position */
+            if((err = move_data(tar, dst, src, len, buf, buf_size)))
+                return err;
+
+            dst += len;
+        }
+
+        tar->state &= ~S_HEADER_VALID;
+        if((err = tseek(tar, src + len)))
+            return err;
+    }
+
+    if(err != MTAR_ENULLRECORD)
+        return err;
+
+    if(found_hole) {
+        if((err = tseek(tar, dst)))
+            return err;
+        if((err = write_null_bytes(tar, 2 * HEADER_LEN)))
+            return err;
+    }
+
+    return mtar_rewind(tar);
+}
+
+int mtar_append(mtar_t* tar)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_READ)
+        return MTAR_EACCESS;
+#endif
+
+    int err;
+
+    /* skip over the remaining members to find the end of the archive */
+    while((err = mtar_next(tar)) == MTAR_ESUCCESS);
+
+    /* reaching end of file without any null records is fine too */
+    if(err == MTAR_EREADFAIL && tar->pos == tar->header_pos)
+        err = MTAR_ENULLRECORD;
+    if(err != MTAR_ENULLRECORD)
+        return err;
+
+    /* new members overwrite the null records */
+    tar->access = MTAR_WRITE;
+    tar->state = 0;
+    return tseek(tar, tar->header_pos);
+}
+
+static int begin_member(mtar_t* tar, const mtar_header_t* h)
+{
+    tar->state &= ~(S_HEADER_VALID | S_WROTE_HEADER | S_WROTE_DATA |
+                    S_WROTE_DATA_EOF | S_DEFERRED | S_AUTO_SIZE);
+
+    /* ensure we have enough space to write the declared amount of data */
+    if(tar->pos > UINT_MAX - HEADER_LEN - round_up_512(h->size))
+        return MTAR_EOVERFLOW;
+
+    tar->header_pos = tar->pos;
+    tar->data_pos = tar->pos + HEADER_LEN;
+    tar->end_pos = tar->data_pos;
+
+    if(h != &tar->header)
+        tar->header = *h;
+
+    return MTAR_ESUCCESS;
+}
+
+static int write_raw_header(mtar_t* tar)
+{
+    int ret = twrite(tar, tar->buffer, HEADER_LEN);
+    if(ret < 0)
+        return ret;
+    if(ret != HEADER_LEN)
+        return MTAR_EWRITEFAIL;
+
+    return MTAR_ESUCCESS;
+}
+
+static int emit_header(mtar_t* tar)
+{
+    int err = header_to_raw(tar->buffer, &tar->header, &tar->header_chksum);
+    if(err)
+        return err;
+
+    return write_raw_header(tar);
+}
+
+/* Writes out the header of a deferred member and any data staged so far */
+static int flush_deferred(mtar_t* tar, unsigned size)
+{
+    int err, ret;
+
+    tar->header.size = size;
+    if((err = emit_header(tar)))
+        return err;
+
+    if(tar->stage_len > 0) {
+        ret = twrite(tar, tar->stage_buf, tar->stage_len);
+        if(ret < 0)
+            return ret;
+        if(ret != (int)tar->stage_len)
+            return MTAR_EWRITEFAIL;
+    }
+
+    tar->stage_len = 0;
+    tar->state &= ~S_DEFERRED;
+    tar->state |= S_HEADER_VALID;
+    return MTAR_ESUCCESS;
+}
+
+int mtar_write_header(mtar_t* tar, const mtar_header_t* h)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_WRITE)
+        return MTAR_EACCESS;
+    if(((tar->state & S_WROTE_DATA) && !(tar->state & S_WROTE_DATA_EOF)) ||
+       (tar->state & S_WROTE_FINALIZE))
+        return MTAR_EAPI;
+#endif
+
+    int err = begin_member(tar, h);
+    if(err)
+        return err;
+
+    err = emit_header(tar);
+    if(err)
+        return err;
+
+    tar->state |= (S_HEADER_VALID | S_WROTE_HEADER);
+    return MTAR_ESUCCESS;
+}
+
+int mtar_init_template(mtar_template_t* tpl, const mtar_header_t* h)
+{
+    unsigned chksum;
+    int err;
+
+    tpl->header = *h;
+    tpl->header.name[0] = '\0';
+    tpl->header.size = 0;
+
+    err = header_to_raw(tpl->raw, &tpl->header, &chksum);
+    if(err)
+        return err;
+
+    /* leave out the size field so it can be added back per member */
+    tpl->chksum = chksum - sum_bytes(&tpl->raw[SIZE_OFF], SIZE_LEN);
+    return MTAR_ESUCCESS;
+}
+
+int mtar_write_template_header(mtar_t* tar, const mtar_template_t* tpl,
+                               const char* name, unsigned size)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_WRITE)
+        return MTAR_EACCESS;
+    if(((tar->state & S_WROTE_DATA) && !(tar->state & S_WROTE_DATA_EOF)) ||
+       (tar->state & S_WROTE_FINALIZE))
+        return MTAR_EAPI;
+#endif
+
+    size_t namelen = strlen(name);
+    if(namelen > NAME_LEN)
+        return MTAR_ENAMETOOLONG;
+
+    tar->header = tpl->header;
+    tar->header.size = size;
+    memcpy(tar->header.name, name, namelen + 1);
+
+    int err = begin_member(tar, &tar->header);
+    if(err)
+        return err;
+
+    /* patch the name and size into the template, and add their bytes
+     * to the checksum of the remaining fields */
+    char* raw = tar->buffer;
+    memcpy(raw, tpl->raw, HEADER_LEN);
+    memcpy(&raw[NAME_OFF], name, namelen);
+
+    if((err = print_octal(&raw[SIZE_OFF], SIZE_LEN, size)))
+        return err;
+
+    unsigned chksum = tpl->chksum + sum_bytes(name, namelen) +
+                      sum_bytes(&raw[SIZE_OFF], SIZE_LEN);
+    if((err = print_octal(&raw[CHKSUM_OFF], CHKSUM_LEN-1, chksum)))
+        return err;
+
+    raw[CHKSUM_OFF + CHKSUM_LEN - 1] = ' ';
+    tar->header_chksum = chksum;
+
+    err = write_raw_header(tar);
+    if(err)
+        return err;
+
+    tar->state |= (S_HEADER_VALID | S_WROTE_HEADER);
+    return MTAR_ESUCCESS;
+}
+
+void mtar_set_stage_buffer(mtar_t* tar, void* buf, unsigned size)
+{
+    tar->stage_buf = buf;
+    tar->stage_size = buf ? size : 0;
+    tar->stage_len = 0;
+}
+
+int mtar_write_header_deferred(mtar_t* tar, const mtar_header_t* h)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_WRITE)
+        return MTAR_EACCESS;
+    if(((tar->state & S_WROTE_DATA) && !(tar->state & S_WROTE_DATA_EOF)) ||
+       (tar->state & S_WROTE_FINALIZE))
+        return MTAR_EAPI;
+#endif
+
+    int err = begin_member(tar, h);
+    if(err)
+        return err;
+
+    tar->header.size = 0;
+    tar->stage_len = 0;
+    tar->state |= (S_WROTE_HEADER | S_DEFERRED | S_AUTO_SIZE);
+    return MTAR_ESUCCESS;
+}
+
+/* Rewrites only the size and checksum of the current header. The new
+ * checksum is derived from the old one by adding the difference between
+ * the old and new size fields, and since the size, mtime and checksum
+ * fields are adjacent they are written out as a single small span. */
+static int update_size_field(mtar_t* tar, unsigned new_size)
+{
+    char span[CHKSUM_OFF + CHKSUM_LEN - SIZE_OFF];
+    char* size_field = &span[0];
+    char* mtime_field = &span[MTIME_OFF - SIZE_OFF];
+    char* chksum_field = &span[CHKSUM_OFF - SIZE_OFF];
+    unsigned chksum;
+    int err;
+
+    if((err = print_octal(size_field, SIZE_LEN, tar->header.size)))
+        return err;
+
+    chksum = tar->header_chksum - sum_bytes(size_field, SIZE_LEN);
+
+    if((err = print_octal(size_field, SIZE_LEN, new_size)))
+        return err;
+
+    chksum += sum_bytes(size_field, SIZE_LEN);
+
+    if((err = print_octal(mtime_field, MTIME_LEN, tar->header.mtime)))
+        return err;
+    if((err = print_octal(chksum_field, CHKSUM_LEN-1, chksum)))
+        return err;
+
+    chksum_field[CHKSUM_LEN - 1] = ' ';
+
+    unsigned old_pos = tar->pos;
+    err = tseek(tar, tar->header_pos + SIZE_OFF);
+    if(err)
+        return err;
+
+    int len = twrite(tar, span, sizeof(span));
+    if(len < 0)
+        return len;
+    if(len != (int)sizeof(span))
+        return MTAR_EWRITEFAIL;
+
+    tar->header.size = new_size;
+    tar->header_chksum = chksum;
+    return tseek(tar, old_pos);
+}
+
+static int only_size_differs(const mtar_header_t* a, const mtar_header_t* b)
+{
+    return a->mode == b->mode && a->owner == b->owner &&
+           a->group == b->group && a->mtime == b->mtime &&
+           a->type == b->type && !strcmp(a->name, b->name) &&
+           !strcmp(a->linkname, b->linkname);
+}
+
+int mtar_update_header(mtar_t* tar, const mtar_header_t* h)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_WRITE)
+        return MTAR_EACCESS;
+    if(!(tar->state & S_WROTE_HEADER) ||
+       (tar->state & S_WROTE_DATA_EOF) ||
+       (tar->state & S_WROTE_FINALIZE))
+        return MTAR_EAPI;
+#endif
+
+    unsigned beg_pos = data_beg_pos(tar);
+    if(beg_pos > UINT_MAX - h->size)
+        return MTAR_EOVERFLOW;
+
+    /* sparse headers can only have their size changed */
+    if(tar->header.type == MTAR_TSPARSE &&
+       (h == &tar->header || !only_size_differs(h, &tar->header)))
+        return MTAR_EAPI;
+
+    /* nothing to rewrite if the header hasn't been written yet */
+    if(tar->state & S_DEFERRED) {
+        if(h != &tar->header)
+            tar->header = *h;
+        return MTAR_ESUCCESS;
+    }
+
+    if(h != &tar->header && only_size_differs(h, &tar->header))
+        return update_size_field(tar, h->size);
+
+    unsigned old_pos = tar->pos;
+    int err = tseek(tar, tar->header_pos);
+    if(err)
+        return err;
+
+    if(h != &tar->header)
+        tar->header = *h;
+
+    err = header_to_raw(tar->buffer, &tar->header, &tar->header_chksum);
+    if(err)
+        return err;
+
+    int len = twrite(tar, tar->buffer, HEADER_LEN);
+    if(len < 0)
+        return len;
+    if(len != HEADER_LEN)
+        return MTAR_EWRITEFAIL;
+
+    return tseek(tar, old_pos);
+}
+
+static int print_sparse_entries(char* raw, const mtar_sparse_t* map,
+                                unsigned n)
+{
+    unsigned i;
+    int err;
+
+    for(i = 0; i < n; ++i, raw += SPARSE_ENTRY_LEN) {
+        if((err = print_octal(raw, SPARSE_FIELD_LEN, map[i].offset)))
+            return err;
+        if((err = print_octal(raw + SPARSE_FIELD_LEN, SPARSE_FIELD_LEN, map[i].size)))
+            return err;
+    }
+
+    return MTAR_ESUCCESS;
+}
+
+int mtar_write_sparse_header(mtar_t* tar, const mtar_header_t* h,
+                             const mtar_sparse_t* map, unsigned count)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_WRITE)
+        return MTAR_EACCESS;
+    if(((tar->state & S_WROTE_DATA) && !(tar->state & S_WROTE_DATA_EOF)) ||
+       (tar->state & S_WROTE_FINALIZE))
+        return MTAR_EAPI;
+#endif
+
+    /* the header's size is the size of the file; only the extents are
+     * stored, so the member's size is the sum of their lengths */
+    unsigned i, size = 0;
+    for(i = 0; i < count; ++i) {
+        if(map[i].size > UINT_MAX - size)
+            return MTAR_EOVERFLOW;
+        if(map[i].offset > h->size || map[i].size > h->size - map[i].offset)
+            return MTAR_EAPI;
+
+        size += map[i].size;
+    }
+
+    unsigned n = count < SPARSE_COUNT ? count : SPARSE_COUNT;
+    unsigned num_ext = (count - n + EXT_SPARSE_COUNT - 1) / EXT_SPARSE_COUNT;
+    if(num_ext > UINT_MAX / HEADER_LEN ||
+       tar->pos > UINT_MAX - num_ext * HEADER_LEN)
+        return MTAR_EOVERFLOW;
+
+    mtar_header_t sh = *h;
+    sh.size = size;
+    sh.type = MTAR_TSPARSE;
+
+    int err = begin_member(tar, &sh);
+    if(err)
+        return err;
+    if(tar->pos > UINT_MAX - HEADER_LEN - num_ext * HEADER_LEN - round_up_512(size))
+        return MTAR_EOVERFLOW;
+
+    /* sparse members are only understood in the old GNU format */
+    char* raw = tar->buffer;
+    if((err = header_to_raw(raw, &tar->header, NULL)))
+        return err;
+
+    memcpy(&raw[GNU_MAGIC_OFF], GNU_MAGIC, GNU_MAGIC_LEN);
+    if((err = print_sparse_entries(&raw[SPARSE_OFF], map, n)))
+        return err;
+    if((err = print_octal(&raw[REALSIZE_OFF], REALSIZE_LEN, h->size)))
+        return err;
+
+    raw[ISEXTENDED_OFF] = num_ext > 0;
+
+    tar->header_chksum = checksum(raw);
+    if((err = print_octal(&raw[CHKSUM_OFF], CHKSUM_LEN-1, tar->header_chksum)))
+        return err;
+
+    raw[CHKSUM_OFF + CHKSUM_LEN - 1] = ' ';
+    if((err = write_raw_header(tar)))
+        return err;
+
+    /* remaining entries go in extension records after the header */
+    for(map += n, count -= n; count > 0; map += n, count -= n) {
+        n = count < EXT_SPARSE_COUNT ? count : EXT_SPARSE_COUNT;
+
+        memset(raw, 0, HEADER_LEN);
+        if((err = print_sparse_entries(raw, map, n)))
+            return err;
+
+        raw[EXT_ISEXTENDED_OFF] = count > n;
+        if((err = write_raw_header(tar)))
+            return err;
+    }
+
+    tar->data_pos = tar->pos;
+    tar->end_pos = tar->pos;
+    tar->state |= (S_HEADER_VALID | S_WROTE_HEADER);
+    return MTAR_ESUCCESS;
+}
+
+int mtar_write_file_header(mtar_t* tar, const char* name, unsigned size)
+{
+#ifndef MICROTAR_DISABLE_API_CHECKS
+    if(tar->access != MTAR_WRITE)
+        return MTAR_EACCESS;
+    if(((tar->state & S_WROTE_DATA) && !(tar->state & S_WROTE_DATA_EOF)) ||
+       (tar->state & S_WROTE_FINALIZE))
         return MTAR_EAPI;
 #endif
 
@@ -633,6 +1635,22 @@ int mtar_write_data(mtar_t* tar, const void* ptr, unsigned size)
 
     tar->state |= S_WROTE_DATA;
 
+    if(tar->state & S_DEFERRED) {
+        unsigned space = tar->stage_size - tar->stage_len;
+        if(size <= space && tar->end_pos <= UINT_MAX - size) {
+            memcpy(&tar->stage_buf[tar->stage_len], ptr, size);
+            tar->stage_len += size;
+            tar->end_pos += size;
+            return size;
+        }
+
+        /* too big to stage, write out the header and fall back to
+         * updating the size by seeking back in mtar_end_data() */
+        int err = flush_deferred(tar, tar->stage_len);
+        if(err)
+            return err;
+    }
+
     int err = twrite(tar, ptr, size);
     if(tar->pos > tar->end_pos)
         tar->end_pos = tar->pos;
@@ -651,13 +1669,15 @@ int mtar_update_file_size(mtar_t* tar)
         return MTAR_EAPI;
 #endif
 
+    /* deferred headers get the right size when they are written */
+    if(tar->state & S_DEFERRED)
+        return MTAR_ESUCCESS;
+
     unsigned new_size = data_end_pos(tar) - data_beg_pos(tar);
     if(new_size == tar->header.size)
         return MTAR_ESUCCESS;
-    else {
-        tar->header.size = new_size;
-        return mtar_update_header(tar, &tar->header);
-    }
+    else
+        return update_size_field(tar, new_size);
 }
 
 int mtar_end_data(mtar_t* tar)
@@ -673,6 +1693,16 @@ int mtar_end_data(mtar_t* tar)
 
     int err;
 
+    if(tar->state & S_DEFERRED) {
+        if(tar->pos > UINT_MAX - HEADER_LEN - round_up_512(tar->stage_len))
+            return MTAR_EOVERFLOW;
+        if((err = flush_deferred(tar, tar->stage_len)))
+            return err;
+    } else if(tar->state & S_AUTO_SIZE) {
+        if((err = mtar_update_file_size(tar)))
+            return err;
+    }
+
     /* ensure the caller wrote the correct amount of data */
     unsigned expected_end = data_beg_pos(tar) + tar->header.size;
     if(tar->end_pos != expected_end)
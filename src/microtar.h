@@ -30,6 +30,9 @@ extern "C" {
 
 #include <stdio.h>  /* SEEK_SET et al. */
 
+/* Position of a member that was not found by mtar_find_members() */
+#define MTAR_NOPOS ((unsigned)-1)
+
 enum mtar_error {
     MTAR_ESUCCESS     =  0,
     MTAR_EFAILURE     = -1,
@@ -46,16 +49,19 @@ enum mtar_error {
     MTAR_ENAMETOOLONG = -12,
     MTAR_EWRONGSIZE   = -13,
     MTAR_EACCESS      = -14,
+    MTAR_ENOMEM       = -15,
+    MTAR_ENOSPC       = -16,
 };
 
 enum mtar_type {
-    MTAR_TREG   = '0',
-    MTAR_TLNK   = '1',
-    MTAR_TSYM   = '2',
-    MTAR_TCHR   = '3',
-    MTAR_TBLK   = '4',
-    MTAR_TDIR   = '5',
-    MTAR_TFIFO  = '6',
+    MTAR_TREG    = '0',
+    MTAR_TLNK    = '1',
+    MTAR_TSYM    = '2',
+    MTAR_TCHR    = '3',
+    MTAR_TBLK    = '4',
+    MTAR_TDIR    = '5',
+    MTAR_TFIFO   = '6',
+    MTAR_TSPARSE = 'S',
 };
 
 enum mtar_access {
@@ -66,6 +72,9 @@ enum mtar_access {
 typedef struct mtar_header mtar_header_t;
 typedef struct mtar mtar_t;
 typedef struct mtar_ops mtar_ops_t;
+typedef struct mtar_member mtar_member_t;
+typedef struct mtar_template mtar_template_t;
+typedef struct mtar_sparse mtar_sparse_t;
 
 typedef int(*mtar_foreach_cb)(mtar_t*, const mtar_header_t*, void*);
 
@@ -80,6 +89,24 @@ struct mtar_header {
     char linkname[101];
 };
 
+struct mtar_member {
+    const char* name;       /* Member name to look up, or NULL to use pos */
+    unsigned pos;           /* Header position, see mtar_tell_member() */
+    mtar_foreach_cb cb;     /* Called when the member is visited */
+    void* arg;              /* Argument passed to the callback */
+};
+
+struct mtar_template {
+    char raw[512];          /* Pre-rendered header without name and size */
+    unsigned chksum;        /* Checksum of everything except name and size */
+    mtar_header_t header;   /* Header the template was made from */
+};
+
+struct mtar_sparse {
+    unsigned offset;        /* Position of the extent in the file */
+    unsigned size;          /* Length of the extent */
+};
+
 struct mtar_ops {
     int(*read)(void* stream, void* data, unsigned size);
     int(*write)(void* stream, const void* data, unsigned size);
@@ -95,7 +122,13 @@ struct mtar {
     unsigned pos;           /* Current position in file */
     unsigned end_pos;       /* End position of the current file */
     unsigned header_pos;    /* Position of the current header */
+    unsigned data_pos;      /* Position of the current member's data */
+    unsigned deleted_pos;   /* Start of the deleted members before it */
+    unsigned header_chksum; /* Checksum of the last written header */
     mtar_header_t header;   /* Most recently parsed header */
+    char* stage_buf;        /* Buffer for data of deferred members */
+    unsigned stage_size;    /* Size of the staging buffer */
+    unsigned stage_len;     /* Amount of data in the staging buffer */
     const mtar_ops_t* ops;  /* Stream operations */
     void* stream;           /* Stream handle */
 };
@@ -111,16 +144,35 @@ int mtar_access_mode(const mtar_t* tar);
 
 int mtar_rewind(mtar_t* tar);
 int mtar_next(mtar_t* tar);
+unsigned mtar_tell_member(mtar_t* tar);
+int mtar_seek_member(mtar_t* tar, unsigned pos);
 int mtar_foreach(mtar_t* tar, mtar_foreach_cb cb, void* arg);
 int mtar_find(mtar_t* tar, const char* name);
+int mtar_find_members(mtar_t* tar, mtar_member_t* members, unsigned count);
+int mtar_visit_members(mtar_t* tar, mtar_member_t* members, unsigned count);
 
 int mtar_read_data(mtar_t* tar, void* ptr, unsigned size);
 int mtar_seek_data(mtar_t* tar, int offset, int whence);
 unsigned mtar_tell_data(mtar_t* tar);
+unsigned mtar_data_offset(mtar_t* tar);
 int mtar_eof_data(mtar_t* tar);
+int mtar_read_sparse_map(mtar_t* tar, mtar_sparse_t* map, unsigned count,
+                         unsigned* realsize);
+
+int mtar_replace_data(mtar_t* tar, const void* ptr, unsigned size);
+int mtar_delete_member(mtar_t* tar);
+int mtar_compact(mtar_t* tar, void* buf, unsigned buf_size);
 
+int mtar_append(mtar_t* tar);
 int mtar_write_header(mtar_t* tar, const mtar_header_t* h);
 int mtar_update_header(mtar_t* tar, const mtar_header_t* h);
+int mtar_init_template(mtar_template_t* tpl, const mtar_header_t* h);
+int mtar_write_template_header(mtar_t* tar, const mtar_template_t* tpl,
+                               const char* name, unsigned size);
+void mtar_set_stage_buffer(mtar_t* tar, void* buf, unsigned size);
+int mtar_write_header_deferred(mtar_t* tar, const mtar_header_t* h);
+int mtar_write_sparse_header(mtar_t* tar, const mtar_header_t* h,
+                             const mtar_sparse_t* map, unsigned count);
 int mtar_write_file_header(mtar_t* tar, const char* name, unsigned size);
 int mtar_write_dir_header(mtar_t* tar, const char* name);
 int mtar_write_data(mtar_t* tar, const void* ptr, unsigned size);